@@ -0,0 +1,8 @@
+#ifndef ALLOCATIONS_HPP
+#define ALLOCATIONS_HPP
+
+// bspbench replaces the global operator new to count every allocation in
+// the process, so checks can tell whether per frame work allocates
+unsigned long allocationCount();
+
+#endif // ALLOCATIONS_HPP
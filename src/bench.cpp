@@ -0,0 +1,1304 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <random>
+#include <vector>
+#include <physfs.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "allocations.hpp"
+#include "bsp.hpp"
+#include "profiler.hpp"
+#include "tesselator.hpp"
+#include "vertexformat.hpp"
+
+#define PI 3.14159265359f
+
+inline float deg2rad(float deg)
+{
+    return deg * PI / 180.f;
+}
+
+// move is where the viewer tried to go this frame, traces go there from
+// the previous frame's position
+struct Camera {
+    glm::vec3 position;
+    float yaw;
+    float pitch;
+    glm::vec3 move;
+};
+
+// Walks between random points inside the map turning slowly, so frames
+// follow each other the same way they do in the viewer
+static std::vector<Camera> makePath(Map& map, int frames, unsigned int seed)
+{
+    std::vector<Camera> path;
+    Bounds bounds = map.getWorldBounds();
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+
+    glm::vec3 from;
+    glm::vec3 to;
+    for (int attempt = 0; attempt < 1000; attempt++)
+    {
+        from = glm::mix(bounds.min, bounds.max, glm::vec3(unit(random), unit(random), unit(random)));
+        if (map.findLeafCluster(from) >= 0)
+            break;
+    }
+    to = from;
+
+    float yaw = 0.f;
+    float step = 8.f;
+    float travelled = 0.f;
+    float distance = 0.f;
+    for (int i = 0; i < frames; i++)
+    {
+        if (travelled >= distance)
+        {
+            from = to;
+            for (int attempt = 0; attempt < 1000; attempt++)
+            {
+                to = glm::mix(bounds.min, bounds.max, glm::vec3(unit(random), unit(random), unit(random)));
+                if (map.findLeafCluster(to) >= 0)
+                    break;
+            }
+            travelled = 0.f;
+            distance = glm::length(to - from);
+        }
+        travelled += step;
+
+        Camera camera;
+        camera.position = distance > 0.f ? glm::mix(from, to, std::min(travelled / distance, 1.f)) : to;
+        yaw += 0.5f;
+        camera.yaw = yaw;
+        camera.pitch = 15.f * std::sin(deg2rad(yaw * 3.f));
+        camera.move = camera.position;
+        path.push_back(camera);
+    }
+    return path;
+}
+
+// Paths recorded by the viewer, one frame per line as
+// x y z yaw pitch [moveX moveY moveZ]
+static bool loadPath(const char* fileName, std::vector<Camera>& path)
+{
+    std::ifstream file(fileName);
+    if (!file)
+    {
+        std::cout << fileName << ": could not open" << std::endl;
+        return false;
+    }
+
+    path.clear();
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++)
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        Camera camera;
+        if (!(fields >> camera.position.x >> camera.position.y >> camera.position.z >> camera.yaw >> camera.pitch))
+        {
+            std::cout << fileName << ":" << number << ": invalid frame" << std::endl;
+            return false;
+        }
+        if (!(fields >> camera.move.x >> camera.move.y >> camera.move.z))
+            camera.move = camera.position;
+        path.push_back(camera);
+    }
+    if (path.empty())
+    {
+        std::cout << fileName << ": no frames" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static glm::mat4 cameraMatrix(const Camera& camera)
+{
+    glm::mat4 view = glm::perspective(deg2rad(75.f), 4.f / 3.f, 1.f, 9000.f);
+    view = glm::rotate(view, deg2rad(-90.f), glm::vec3(1.f, 0.f, 0.f));
+    view = glm::rotate(view, deg2rad(camera.pitch), glm::vec3(1.f, 0.f, 0.f));
+    view = glm::rotate(view, deg2rad(camera.yaw + 90.f), glm::vec3(0.f, 0.f, 1.f));
+    return glm::translate(view, -camera.position);
+}
+
+// Patch tolerance is in pixels on a 600 pixel high view
+static void runCulling(Map& map, const std::vector<Camera>& path, const char* name, bool planeMasks, float patchTolerance)
+{
+    RenderPass pass;
+    pass.planeMasks = planeMasks;
+    pass.patchTolerance = patchTolerance * 2.f / 600.f;
+    DrawList list;
+
+    double boxTests = 0;
+    double planeTests = 0;
+    double faces = 0;
+    double triangles = 0;
+    double batches = 0;
+    double ranges = 0;
+    double binds = 0;
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for (std::size_t i = 0; i < path.size(); i++)
+    {
+        pass.reset(path[i].position, cameraMatrix(path[i]));
+        for (int solid = 1; solid >= 0; solid--)
+        {
+            map.cullWorld(pass, solid != 0);
+            map.batchFaces(pass, solid != 0, list);
+            faces += list.faces;
+            triangles += list.triangles;
+            batches += list.batches.size();
+            ranges += list.rangeOffsets.size();
+            binds += list.stateChanges;
+        }
+        boxTests += pass.boxTests;
+        planeTests += pass.planeTests;
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+    double frames = path.empty() ? 1 : path.size();
+    std::cout << name
+              << ": boxes/frame " << boxTests / frames
+              << ", planes/frame " << planeTests / frames
+              << ", faces/frame " << faces / frames
+              << ", triangles/frame " << triangles / frames
+              << ", ms/frame " << elapsed.count() / frames << std::endl;
+    std::cout << name
+              << ": draws/frame " << batches / frames
+              << " (" << ranges / frames << " ranges, " << faces / frames << " unbatched)"
+              << ", binds/frame " << binds / frames
+              << " (" << faces * 2 / frames << " unbatched)" << std::endl;
+}
+
+// Packs every vertex with each layout and decodes it again. Lightmap
+// coordinates are measured in texels of an atlas page and have to stay
+// within 1/16 of a texel. Returns false if any attribute is off by more
+// than its format allows.
+static bool runVertexFormats(Map& map)
+{
+    const LumpArray<Vertex>& vertices = map.getVertices();
+    const LightMapAtlas& atlas = map.getLightMapAtlas();
+    glm::vec2 pageSize((float)atlas.width(), (float)atlas.height());
+    Bounds bounds = vertexBounds(vertices.data(), vertices.size());
+    const char* names[] = { "full", "packed", "quantized" };
+    bool passed = true;
+
+    for (int format = VERTEXFORMAT_FULL; format <= VERTEXFORMAT_QUANTIZED; format++)
+    {
+        VertexLayout layout = VertexLayout::create((VertexFormat)format, bounds);
+        std::vector<unsigned char> packed(vertices.size() * layout.stride + 1);
+        layout.pack(vertices.data(), vertices.size(), &packed[0]);
+
+        // 16 bit positions span the map bounds, 10 bit normals span -1 to 1
+        float positionBound = format == VERTEXFORMAT_QUANTIZED ? std::max(layout.positionScale.x, std::max(layout.positionScale.y, layout.positionScale.z)) / 65535.f : 0.f;
+        float normalBound = format == VERTEXFORMAT_FULL ? 0.f : 0.5f / 511.f + 1e-6f;
+        float texelBound = 1.f / 16.f;
+
+        float positionError = 0.f;
+        float normalError = 0.f;
+        float texCoordError = 0.f;
+        float texelError = 0.f;
+        bool withinBounds = true;
+        for (std::size_t i = 0; i < vertices.size(); i++)
+        {
+            const Vertex& vertex = vertices[i];
+            Vertex decoded = layout.unpack(&packed[i * layout.stride]);
+            glm::vec3 position = glm::abs(decoded.position - vertex.position);
+            glm::vec3 normal = glm::abs(decoded.normal - glm::clamp(vertex.normal, -1.f, 1.f));
+            glm::vec2 texCoord = glm::abs(decoded.texCoord - vertex.texCoord);
+            glm::vec2 texels = glm::abs(decoded.lmCoord - vertex.lmCoord) * pageSize;
+
+            float positionMax = std::max(position.x, std::max(position.y, position.z));
+            float normalMax = std::max(normal.x, std::max(normal.y, normal.z));
+            float texCoordMax = std::max(texCoord.x, texCoord.y);
+            float texelMax = std::max(texels.x, texels.y);
+
+            positionError = std::max(positionError, positionMax);
+            normalError = std::max(normalError, normalMax);
+            texCoordError = std::max(texCoordError, texCoordMax);
+            texelError = std::max(texelError, texelMax);
+            if (positionMax > positionBound || normalMax > normalBound || texCoordMax > 0.f || texelMax > texelBound)
+                withinBounds = false;
+            if (memcmp(decoded.colour, vertex.colour, 4) != 0)
+                withinBounds = false;
+        }
+        passed = passed && withinBounds;
+
+        std::cout << "vertex " << names[format]
+                  << ": " << layout.stride << " bytes, "
+                  << vertices.size() * layout.stride / 1024 << " KiB"
+                  << ", position error " << positionError
+                  << ", normal error " << normalError
+                  << ", texcoord error " << texCoordError
+                  << ", lightmap error " << texelError << " texels"
+                  << (withinBounds ? ", ok" : ", OUT OF BOUNDS") << std::endl;
+    }
+    return passed;
+}
+
+// Builds atlases for a few lightmap counts and size limits. Pages have to
+// be powers of two within the limit, and the corners of every cell have to
+// stay half a texel inside it so filtering does not reach its neighbours.
+static bool runLightMapAtlas()
+{
+    const int counts[] = { 0, 5, 300 };
+    const int sizes[] = { 128, 384, 2048, 3000 };
+    const glm::vec2 corners[] = { glm::vec2(0.f), glm::vec2(1.f), glm::vec2(-1.f, 2.f) };
+    int checked = 0;
+    bool passed = true;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            LightMapAtlas atlas;
+            atlas.build(counts[i], sizes[j]);
+            int width = atlas.width();
+            int height = atlas.height();
+            if (width > sizes[j] || height > sizes[j] || (width & (width - 1)) != 0 || (height & (height - 1)) != 0)
+                passed = false;
+            if (atlas.pages * atlas.columns * atlas.rows < atlas.cells)
+                passed = false;
+
+            for (int cell = 0; cell < atlas.cells; cell++)
+            {
+                int index = cell % (atlas.columns * atlas.rows);
+                glm::vec2 origin((float)(index % atlas.columns * LIGHTMAP_SIZE), (float)(index / atlas.columns * LIGHTMAP_SIZE));
+                for (int k = 0; k < 3; k++)
+                {
+                    glm::vec2 texel = atlas.remap(cell, corners[k]) * glm::vec2((float)width, (float)height) - origin;
+                    if (texel.x < 0.499f || texel.y < 0.499f || texel.x > LIGHTMAP_SIZE - 0.499f || texel.y > LIGHTMAP_SIZE - 0.499f)
+                        passed = false;
+                    checked++;
+                }
+            }
+        }
+    }
+    std::cout << "lightmap atlas: " << checked << " cell corners, " << (passed ? "ok" : "FAILED") << std::endl;
+    return passed;
+}
+
+// The tessellation the map loader used before Tesselator, kept to compare
+// against. It goes through whole Vertex temporaries and skips the colour.
+static Vertex operator+(const Vertex& v1, const Vertex& v2)
+{
+    Vertex temp;
+    temp.position = v1.position + v2.position;
+    temp.texCoord = v1.texCoord + v2.texCoord;
+    temp.lmCoord = v1.lmCoord + v2.lmCoord;
+    temp.normal = v1.normal + v2.normal;
+    return temp;
+}
+
+static Vertex operator*(const Vertex& v1, const float& d)
+{
+    Vertex temp;
+    temp.position = v1.position * d;
+    temp.texCoord = v1.texCoord * d;
+    temp.lmCoord = v1.lmCoord * d;
+    temp.normal = v1.normal * d;
+    return temp;
+}
+
+static void referenceTesselate(const Vertex* controls, int level, Vertex* out)
+{
+    int L1 = level + 1;
+    for (int j = 0; j <= level; ++j)
+    {
+        float a = (float)j / level;
+        float b = 1.f - a;
+        out[j] = controls[0] * b * b + controls[3] * 2 * b * a + controls[6] * a * a;
+    }
+
+    for (int i = 1; i <= level; ++i)
+    {
+        float a = (float)i / level;
+        float b = 1.f - a;
+
+        Vertex temp[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            int k = 3 * j;
+            temp[j] = controls[k + 0] * b * b + controls[k + 1] * 2 * b * a + controls[k + 2] * a * a;
+        }
+
+        for (int j = 0; j <= level; ++j)
+        {
+            float a = (float)j / level;
+            float b = 1.f - a;
+            out[i * L1 + j] = temp[0] * b * b + temp[1] * 2 * b * a + temp[2] * a * a;
+        }
+    }
+}
+
+// Tessellates random patches with the old code, the kernel on one thread and
+// the kernel split across the pool. Returns false if the kernel's positions
+// stray from the old code's.
+static bool runTesselation(ThreadPool& pool)
+{
+    const int patches = 4096;
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> unit(-512.f, 512.f);
+    std::vector<Vertex> controls(patches * 9);
+    for (std::size_t i = 0; i < controls.size(); i++)
+    {
+        Vertex& control = controls[i];
+        control.position = glm::vec3(unit(random), unit(random), unit(random));
+        control.texCoord = glm::vec2(unit(random), unit(random)) / 512.f;
+        control.lmCoord = glm::vec2(unit(random), unit(random)) / 1024.f + 0.5f;
+        control.normal = glm::normalize(glm::vec3(unit(random), unit(random), unit(random)) + 0.01f);
+        for (int j = 0; j < 4; j++)
+            control.colour[j] = (unsigned char)(random() & 0xff);
+    }
+
+    bool passed = true;
+    const int levels[] = { 3, 8, 16 };
+    for (int l = 0; l < 3; l++)
+    {
+        int level = levels[l];
+        int size = (level + 1) * (level + 1);
+        std::vector<Vertex> expected(patches * size);
+        std::vector<Vertex> single(patches * size);
+        std::vector<Vertex> threaded(patches * size);
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < patches; i++)
+        {
+            referenceTesselate(&controls[i * 9], level, &expected[i * size]);
+        }
+        std::chrono::duration<double, std::milli> reference = std::chrono::high_resolution_clock::now() - start;
+
+        Tesselator tesselator(level);
+        std::vector<PatchJob> jobs(patches);
+        for (int i = 0; i < patches; i++)
+        {
+            jobs[i].controls = &controls[i * 9];
+            jobs[i].controlWidth = 3;
+            jobs[i].out = &single[i * size];
+            jobs[i].rowStride = level + 1;
+        }
+        start = std::chrono::high_resolution_clock::now();
+        tesselator.run(&jobs[0], patches);
+        std::chrono::duration<double, std::milli> kernel = std::chrono::high_resolution_clock::now() - start;
+
+        for (int i = 0; i < patches; i++)
+        {
+            jobs[i].out = &threaded[i * size];
+        }
+        start = std::chrono::high_resolution_clock::now();
+        TaskGraph graph;
+        graph.addRange(patches, 64, [&](int begin, int end)
+        {
+            tesselator.run(&jobs[begin], end - begin);
+        }, std::vector<TaskGraph::Task>());
+        graph.run(&pool);
+        std::chrono::duration<double, std::milli> parallel = std::chrono::high_resolution_clock::now() - start;
+
+        float error = 0.f;
+        bool same = true;
+        for (std::size_t i = 0; i < expected.size(); i++)
+        {
+            glm::vec3 difference = glm::abs(single[i].position - expected[i].position);
+            error = std::max(error, std::max(difference.x, std::max(difference.y, difference.z)));
+            same = same && memcmp(&single[i], &threaded[i], sizeof(Vertex)) == 0;
+        }
+        bool ok = same && error < 1e-3f;
+        passed = passed && ok;
+
+        std::cout << "tesselate level " << level
+                  << ": reference " << reference.count()
+                  << " ms, kernel " << kernel.count()
+                  << " ms, pool of " << pool.size() << " workers " << parallel.count()
+                  << " ms, position error " << error
+                  << (ok ? ", ok" : ", MISMATCH") << std::endl;
+    }
+    return passed;
+}
+
+// Moves random spheres through the map in batches with one thread, four
+// threads and every core. Returns false if a batch disagrees with tracing
+// the same movers one at a time.
+static bool runTraces(Map& map, int batches)
+{
+    const int movers = 4096;
+    Bounds bounds = map.getWorldBounds();
+    std::mt19937 random(2);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::uniform_real_distribution<float> step(-16.f, 16.f);
+
+    std::vector<glm::vec3> oldPositions(movers);
+    std::vector<glm::vec3> positions(movers);
+    std::vector<float> radii(movers);
+    for (int i = 0; i < movers; i++)
+    {
+        oldPositions[i] = glm::mix(bounds.min, bounds.max, glm::vec3(unit(random), unit(random), unit(random)));
+        positions[i] = oldPositions[i] + glm::vec3(step(random), step(random), step(random));
+        radii[i] = 8.f + 16.f * unit(random);
+    }
+
+    std::vector<glm::vec3> expected(movers);
+    for (int i = 0; i < movers; i++)
+    {
+        expected[i] = map.traceWorld(positions[i], oldPositions[i], radii[i]);
+    }
+
+    bool passed = true;
+    TracePass pass;
+    for (int bounded = 0; bounded < 2; bounded++)
+    {
+        pass.brushBounds = bounded != 0;
+        double brushes = 0;
+        double sides = 0;
+        bool same = true;
+        for (int i = 0; i < movers; i++)
+        {
+            glm::vec3 position = map.traceWorld(pass, positions[i], oldPositions[i], radii[i]);
+            same = same && position == expected[i];
+            brushes += pass.brushTests;
+            sides += pass.sideTests;
+        }
+        passed = passed && same;
+
+        std::cout << "trace " << (bounded ? "brush bounds" : "all brushes")
+                  << ": brushes/trace " << brushes / movers
+                  << ", sides/trace " << sides / movers
+                  << (same ? ", ok" : ", MISMATCH") << std::endl;
+    }
+
+    const unsigned int threads[] = { 1, 4, ThreadPool::defaultThreads() + 1 };
+    std::vector<glm::vec3> out(movers);
+    for (int t = 0; t < 3; t++)
+    {
+        ThreadPool pool(threads[t] - 1);
+        map.traceWorld(&positions[0], &oldPositions[0], &radii[0], &out[0], movers, &pool);
+        bool same = memcmp(&out[0], &expected[0], movers * sizeof(glm::vec3)) == 0;
+        passed = passed && same;
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < batches; i++)
+        {
+            map.traceWorld(&positions[0], &oldPositions[0], &radii[0], &out[0], movers, &pool);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+        std::cout << "trace " << threads[t] << " threads: "
+                  << (double)movers * batches / std::max(elapsed.count(), 1e-9) << " traces/s"
+                  << (same ? ", ok" : ", MISMATCH") << std::endl;
+    }
+    return passed;
+}
+
+template <typename T>
+static void appendLump(std::vector<char>& file, int lump, const T* items, std::size_t count)
+{
+    int entry[2] = { (int)file.size(), (int)(count * sizeof(T)) };
+    memcpy(&file[8 + lump * 8], entry, sizeof(entry));
+    if (count > 0)
+        file.insert(file.end(), (const char*)items, (const char*)(items + count));
+}
+
+// Two brushes in one leaf: a wedge with a sloped side, and a box that the
+// move's bounds miss. The sphere comes down onto the slope and is pushed
+// out along it into the box, which brush bounds have to test again. The
+// map is written to the working directory and loaded through PhysFS.
+static bool runSlopedPush()
+{
+    const float s = 0.70710678f;
+    const Plane planes[] = {
+        {glm::vec3(s, s, 0.f), 0.f},
+        {glm::vec3(-1.f, 0.f, 0.f), 64.f}, {glm::vec3(1.f, 0.f, 0.f), 64.f},
+        {glm::vec3(0.f, -1.f, 0.f), 64.f}, {glm::vec3(0.f, 1.f, 0.f), 64.f},
+        {glm::vec3(0.f, 0.f, -1.f), 64.f}, {glm::vec3(0.f, 0.f, 1.f), 64.f},
+        {glm::vec3(-1.f, 0.f, 0.f), -30.f}, {glm::vec3(0.f, -1.f, 0.f), 40.f}, {glm::vec3(0.f, 1.f, 0.f), 0.f},
+        {glm::vec3(1.f, 0.f, 0.f), -1024.f}
+    };
+    const BrushSide sides[] = {
+        {0, 0}, {1, 0}, {2, 0}, {3, 0}, {4, 0}, {5, 0}, {6, 0},
+        {7, 0}, {2, 0}, {8, 0}, {9, 0}, {5, 0}, {6, 0}
+    };
+    const Brush brushes[] = { {0, 7, 0}, {7, 6, 0} };
+    const int leafBrushes[] = { 0, 1 };
+    const Node nodes[] = { {10, {~0, ~1}, {-1024, -1024, -1024}, {1024, 1024, 1024}} };
+    const Leaf leaves[] = {
+        {-1, 0, {-1024, -1024, -1024}, {1024, 1024, 1024}, 0, 0, 0, 2},
+        {-1, 0, {-1024, -1024, -1024}, {-1024, 1024, 1024}, 0, 0, 2, 0}
+    };
+    const Model models[] = { {glm::vec3(-64.f), glm::vec3(64.f), 0, 0, 0, 2} };
+    struct { char name[64]; int surface; int contents; } shader = { "textures/bench/solid", 0, CONTENTS_SOLID };
+
+    std::vector<char> file(8 + 17 * 8, 0);
+    memcpy(&file[0], "IBSP", 4);
+    file[4] = 0x2e;
+    appendLump(file, 1, &shader, 1);
+    appendLump(file, 2, planes, sizeof(planes) / sizeof(planes[0]));
+    appendLump(file, 3, nodes, 1);
+    appendLump(file, 4, leaves, 2);
+    appendLump(file, 6, leafBrushes, 2);
+    appendLump(file, 7, models, 1);
+    appendLump(file, 8, brushes, 2);
+    appendLump(file, 9, sides, sizeof(sides) / sizeof(sides[0]));
+
+    const char* fileName = "bspbench-slope.bsp";
+    std::ofstream out(fileName, std::ios::binary);
+    out.write(&file[0], file.size());
+    out.close();
+    if (!out || !PHYSFS_mount(".", "/bspbench", 1))
+    {
+        std::cout << fileName << ": could not write" << std::endl;
+        return false;
+    }
+
+    bool passed;
+    {
+        Map map;
+        passed = map.load(std::string("/bspbench/") + fileName);
+        glm::vec3 results[2];
+        int brushTests[2] = {0, 0};
+        TracePass pass;
+        for (int bounded = 0; passed && bounded < 2; bounded++)
+        {
+            pass.brushBounds = bounded != 0;
+            results[bounded] = map.traceWorld(pass, glm::vec3(20.f, -30.f, 0.f), glm::vec3(20.f, 0.f, 0.f), 8.f);
+            brushTests[bounded] = pass.brushTests;
+        }
+        passed = passed && results[0] == results[1] && brushTests[1] == 2;
+        std::cout << "trace sloped push: " << brushTests[1] << " of 2 brushes tested with brush bounds, "
+                  << (passed ? "ok" : "MISMATCH") << std::endl;
+    }
+    remove(fileName);
+    return passed;
+}
+
+// Sweeps random spheres and boxes across the map. A long sweep has to stop
+// where the same move taken in eight steps first hits something, and never
+// end up inside a brush.
+static bool runSweeps(Map& map, int count)
+{
+    Bounds bounds = map.getWorldBounds();
+    std::mt19937 random(3);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::uniform_real_distribution<float> step(-256.f, 256.f);
+    const glm::vec3 mins(-15.f, -15.f, -24.f);
+    const glm::vec3 maxs(15.f, 15.f, 32.f);
+
+    std::vector<glm::vec3> starts;
+    std::vector<glm::vec3> ends;
+    while ((int)starts.size() < count)
+    {
+        glm::vec3 start = glm::mix(bounds.min, bounds.max, glm::vec3(unit(random), unit(random), unit(random)));
+        if (map.traceBox(start, start, mins, maxs).startSolid || map.traceSphere(start, start, 16.f).startSolid)
+            continue;
+        starts.push_back(start);
+        ends.push_back(start + glm::vec3(step(random), step(random), step(random)));
+    }
+
+    bool passed = true;
+    for (int shape = 0; shape < 2; shape++)
+    {
+        int hits = 0;
+        int failures = 0;
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < count; i++)
+        {
+            TraceResult result = shape == 0 ? map.traceSphere(starts[i], ends[i], 16.f) : map.traceBox(starts[i], ends[i], mins, maxs);
+            hits += result.fraction < 1.f;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+        SweepPass bounded;
+        SweepPass unbounded;
+        unbounded.brushBounds = false;
+        double boundedSides = 0;
+        double unboundedSides = 0;
+        for (int i = 0; i < count; i++)
+        {
+            TraceResult result = shape == 0 ? map.traceSphere(bounded, starts[i], ends[i], 16.f) : map.traceBox(bounded, starts[i], ends[i], mins, maxs);
+            TraceResult check = shape == 0 ? map.traceSphere(unbounded, starts[i], ends[i], 16.f) : map.traceBox(unbounded, starts[i], ends[i], mins, maxs);
+            boundedSides += bounded.sideTests;
+            unboundedSides += unbounded.sideTests;
+            TraceResult rest = shape == 0 ? map.traceSphere(result.end, result.end, 16.f) : map.traceBox(result.end, result.end, mins, maxs);
+
+            glm::vec3 position = starts[i];
+            for (int j = 1; j <= 8; j++)
+            {
+                glm::vec3 target = glm::mix(starts[i], ends[i], j / 8.f);
+                TraceResult piece = shape == 0 ? map.traceSphere(position, target, 16.f) : map.traceBox(position, target, mins, maxs);
+                position = piece.end;
+                if (piece.fraction < 1.f)
+                    break;
+            }
+
+            if (result.startSolid || rest.startSolid || glm::length(position - result.end) > 0.5f)
+                failures++;
+            if (check.fraction != result.fraction || check.brush != result.brush)
+                failures++;
+        }
+        passed = passed && failures == 0;
+
+        std::cout << "sweep " << (shape == 0 ? "sphere" : "box")
+                  << ": " << count / std::max(elapsed.count(), 1e-9) << " traces/s, "
+                  << hits * 100.f / count << "% hit"
+                  << ", sides/trace " << boundedSides / count
+                  << " (" << unboundedSides / count << " without brush bounds)"
+                  << (failures == 0 ? ", ok" : ", FAILED") << std::endl;
+    }
+    return passed;
+}
+
+struct WalkResults {
+    std::vector<int> leaves;
+    std::vector<int> faces;
+    std::vector<glm::vec3> traces;
+    std::vector<glm::vec3> sweepEnds;
+    std::vector<float> sweepFractions;
+
+    bool operator==(const WalkResults& other) const
+    {
+        return leaves == other.leaves && faces == other.faces && traces == other.traces
+            && sweepEnds == other.sweepEnds && sweepFractions == other.sweepFractions;
+    }
+};
+
+// Point in leaf lookups, tree culling, traces and box sweeps, everything
+// that walks the tree
+static WalkResults runWalk(Map& map, const std::vector<Camera>& path, const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& oldPositions, const char* name)
+{
+    std::size_t points = positions.size();
+    WalkResults results;
+    results.leaves.resize(points);
+    results.traces.resize(points);
+    results.sweepEnds.resize(points);
+    results.sweepFractions.resize(points);
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for (std::size_t i = 0; i < points; i++)
+    {
+        glm::vec3 position = positions[i];
+        results.leaves[i] = map.findLeaf(position);
+    }
+    std::chrono::duration<double> leafTime = std::chrono::high_resolution_clock::now() - start;
+
+    RenderPass pass;
+    start = std::chrono::high_resolution_clock::now();
+    for (std::size_t i = 0; i < path.size(); i++)
+    {
+        pass.reset(path[i].position, cameraMatrix(path[i]));
+        for (int solid = 1; solid >= 0; solid--)
+        {
+            map.cullWorld(pass, solid != 0);
+            results.faces.insert(results.faces.end(), pass.visibleFaces.begin(), pass.visibleFaces.end());
+        }
+    }
+    std::chrono::duration<double, std::milli> cullTime = std::chrono::high_resolution_clock::now() - start;
+
+    start = std::chrono::high_resolution_clock::now();
+    for (std::size_t i = 0; i < points; i++)
+    {
+        results.traces[i] = map.traceWorld(positions[i], oldPositions[i], 16.f);
+    }
+    std::chrono::duration<double> traceTime = std::chrono::high_resolution_clock::now() - start;
+
+    glm::vec3 mins(-15.f, -15.f, -24.f);
+    glm::vec3 maxs(15.f, 15.f, 32.f);
+    start = std::chrono::high_resolution_clock::now();
+    for (std::size_t i = 0; i < points; i++)
+    {
+        TraceResult result = map.traceBox(oldPositions[i], positions[i], mins, maxs);
+        results.sweepEnds[i] = result.end;
+        results.sweepFractions[i] = result.fraction;
+    }
+    std::chrono::duration<double> sweepTime = std::chrono::high_resolution_clock::now() - start;
+
+    std::cout << name
+              << ": " << points / std::max(leafTime.count(), 1e-9) << " leaves/s"
+              << ", cull ms/frame " << cullTime.count() / std::max<std::size_t>(path.size(), 1)
+              << ", " << points / std::max(traceTime.count(), 1e-9) << " traces/s"
+              << ", " << points / std::max(sweepTime.count(), 1e-9) << " sweeps/s" << std::endl;
+    return results;
+}
+
+static void makeMoves(Map& map, int count, std::vector<glm::vec3>& positions, std::vector<glm::vec3>& oldPositions)
+{
+    Bounds bounds = map.getWorldBounds();
+    std::mt19937 random(4);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::uniform_real_distribution<float> step(-16.f, 16.f);
+    positions.resize(count);
+    oldPositions.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        positions[i] = glm::mix(bounds.min, bounds.max, glm::vec3(unit(random), unit(random), unit(random)));
+        oldPositions[i] = positions[i] + glm::vec3(step(random), step(random), step(random));
+    }
+}
+
+// The file's own nodes against the flattened ones. Returns false if they
+// disagree.
+static bool runNodes(Map& map, const std::vector<Camera>& path)
+{
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> oldPositions;
+    makeMoves(map, 65536, positions, oldPositions);
+
+    map.setFlatNodes(false);
+    WalkResults file = runWalk(map, path, positions, oldPositions, "nodes file");
+    map.setFlatNodes(true);
+    WalkResults flat = runWalk(map, path, positions, oldPositions, "nodes flat");
+
+    bool same = file == flat;
+    std::cout << "nodes: " << (same ? "ok" : "MISMATCH") << std::endl;
+    return same;
+}
+
+// Dot products on every plane against the axial fast path. Returns false
+// if they disagree.
+static bool runPlanes(Map& map, const std::vector<Camera>& path)
+{
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> oldPositions;
+    makeMoves(map, 65536, positions, oldPositions);
+
+    map.setAxialPlanes(false);
+    WalkResults generic = runWalk(map, path, positions, oldPositions, "planes generic");
+    map.setAxialPlanes(true);
+    WalkResults axial = runWalk(map, path, positions, oldPositions, "planes axial");
+
+    bool same = generic == axial;
+    std::cout << "planes: " << (same ? "ok" : "MISMATCH") << std::endl;
+    return same;
+}
+
+// Samples lightvols one at a time and in a batch, the count is not a
+// multiple of four so the batch ends on single samples. Returns false if
+// the two disagree, or a sample on a lit cell's corner is not that cell.
+static bool runLightGrid(Map& map, int count)
+{
+    const LightGrid& grid = map.getLightGrid();
+    if (grid.empty())
+    {
+        std::cout << "lightgrid: no lightvols" << std::endl;
+        return true;
+    }
+
+    // Reaching past the world bounds checks the clamping at the edges
+    Bounds bounds = map.getWorldBounds();
+    glm::vec3 margin = (bounds.max - bounds.min) * 0.1f;
+    std::mt19937 random(5);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::vector<float> positions[3];
+    for (int j = 0; j < 3; j++)
+        positions[j].resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        glm::vec3 position = glm::mix(bounds.min - margin, bounds.max + margin, glm::vec3(unit(random), unit(random), unit(random)));
+        for (int j = 0; j < 3; j++)
+            positions[j][i] = position[j];
+    }
+
+    std::vector<float> results[9];
+    LightGridBatch batch;
+    for (int j = 0; j < 9; j++)
+        results[j].resize(count);
+    for (int j = 0; j < 3; j++)
+    {
+        batch.position[j] = &positions[j][0];
+        batch.ambient[j] = &results[j][0];
+        batch.directional[j] = &results[3 + j][0];
+        batch.direction[j] = &results[6 + j][0];
+    }
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    grid.sample(batch, count);
+    std::chrono::duration<double> batchTime = std::chrono::high_resolution_clock::now() - start;
+
+    std::vector<LightVol> single(count);
+    start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < count; i++)
+        grid.sample(glm::vec3(positions[0][i], positions[1][i], positions[2][i]), single[i]);
+    std::chrono::duration<double> singleTime = std::chrono::high_resolution_clock::now() - start;
+
+    float error = 0.f;
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            error = std::max(error, std::fabs(results[j][i] - single[i].ambient[j]));
+            error = std::max(error, std::fabs(results[3 + j][i] - single[i].directional[j]));
+            error = std::max(error, std::fabs(results[6 + j][i] - single[i].direction[j]));
+        }
+    }
+
+    // Cell corners sit on multiples of the cell size
+    float cornerError = 0.f;
+    for (int i = 0; i < count; i++)
+    {
+        glm::vec3 corner(positions[0][i], positions[1][i], positions[2][i]);
+        corner = glm::clamp(corner, bounds.min, bounds.max);
+        corner.x = std::ceil(corner.x / 64.f) * 64.f;
+        corner.y = std::ceil(corner.y / 64.f) * 64.f;
+        corner.z = std::ceil(corner.z / 128.f) * 128.f;
+        LightVol cell = grid.nearest(corner);
+        if (cell.ambient.x + cell.ambient.y + cell.ambient.z == 0.f)
+            continue;
+        LightVol blended;
+        grid.sample(corner, blended);
+        cornerError = std::max(cornerError, glm::length(blended.ambient - cell.ambient));
+        cornerError = std::max(cornerError, glm::length(blended.directional - cell.directional));
+        cornerError = std::max(cornerError, glm::length(blended.direction - glm::normalize(cell.direction)));
+    }
+
+    bool passed = error <= 1e-5f && cornerError <= 1e-5f;
+    std::cout << "lightgrid: " << count / std::max(singleTime.count(), 1e-9) << " samples/s single, "
+              << count / std::max(batchTime.count(), 1e-9) << " samples/s batched, batch error " << error
+              << ", corner error " << cornerError << ", " << (passed ? "ok" : "FAILED") << std::endl;
+    return passed;
+}
+
+// Culls, batches and traces along the path, the first frame sets up the
+// passes. Batches go to a pool of three workers so the pool's queue is
+// covered as well. Returns false if any later frame allocates. Profile
+// builds stop recording zones meanwhile, their buffers grow until the next
+// frame is closed.
+static bool runAllocations(Map& map, const std::vector<Camera>& path)
+{
+#ifdef BSP_PROFILE
+    Profiler::instance().setPaused(true);
+#endif
+    ThreadPool pool(3);
+    const int batchSize = 256;
+    std::vector<glm::vec3> positions(batchSize);
+    std::vector<glm::vec3> oldPositions(batchSize);
+    std::vector<glm::vec3> out(batchSize);
+    std::vector<float> radii(batchSize, 10.f);
+
+    RenderPass pass;
+    pass.planeMasks = true;
+    pass.patchTolerance = 2.f * 2.f / 600.f;
+    DrawList list;
+    unsigned long culling = 0;
+    unsigned long batching = 0;
+    unsigned long traces = 0;
+    unsigned long batches = 0;
+    std::size_t frames = std::min(path.size(), (std::size_t)500);
+    for (std::size_t i = 0; i < frames; i++)
+    {
+        for (int j = 0; j < batchSize; j++)
+        {
+            const Camera& camera = path[(i + j) % path.size()];
+            positions[j] = camera.move;
+            oldPositions[j] = camera.position;
+        }
+
+        unsigned long counts[4] = {0, 0, 0, 0};
+        pass.reset(path[i].position, cameraMatrix(path[i]));
+        for (int solid = 1; solid >= 0; solid--)
+        {
+            unsigned long before = allocationCount();
+            map.cullWorld(pass, solid != 0);
+            counts[0] += allocationCount() - before;
+            before = allocationCount();
+            map.batchFaces(pass, solid != 0, list);
+            counts[1] += allocationCount() - before;
+        }
+        unsigned long before = allocationCount();
+        map.traceWorld(path[i].move, path[i].position, 10.f);
+        counts[2] = allocationCount() - before;
+        before = allocationCount();
+        map.traceWorld(&positions[0], &oldPositions[0], &radii[0], &out[0], batchSize, &pool);
+        counts[3] = allocationCount() - before;
+
+        if (i == 0)
+            continue;
+        culling += counts[0];
+        batching += counts[1];
+        traces += counts[2];
+        batches += counts[3];
+    }
+
+#ifdef BSP_PROFILE
+    Profiler::instance().setPaused(false);
+#endif
+
+    bool passed = culling == 0 && batching == 0 && traces == 0 && batches == 0;
+    std::cout << "allocations after the first of " << frames << " frames: cullWorld " << culling
+              << ", batchFaces " << batching << ", traceWorld " << traces << ", batched traceWorld " << batches
+              << ", " << (passed ? "ok" : "FAILED") << std::endl;
+    return passed;
+}
+
+typedef std::map<std::string, std::string> ReferenceEntity;
+
+// Quoted pairs only, one std::string per key and value
+static bool referenceEntities(const std::string& text, std::vector<ReferenceEntity>& out)
+{
+    std::vector<std::string> tokens;
+    for (std::size_t i = 0; i < text.size(); i++)
+    {
+        if (text.compare(i, 2, "//") == 0)
+            i = std::min(text.find('\n', i), text.size());
+        else if (text[i] == '{' || text[i] == '}')
+            tokens.push_back(std::string(1, text[i]));
+        else if (text[i] == '"')
+        {
+            std::size_t end = text.find('"', i + 1);
+            if (end == std::string::npos)
+                return false;
+            tokens.push_back(text.substr(i, end - i));
+            i = end;
+        }
+    }
+    for (std::size_t i = 0; i < tokens.size(); i++)
+    {
+        if (tokens[i] != "{")
+            return false;
+        ReferenceEntity entity;
+        for (i++; i + 1 < tokens.size() && tokens[i] != "}"; i += 2)
+            entity.insert(std::make_pair(tokens[i].substr(1), tokens[i + 1].substr(1)));
+        out.push_back(entity);
+    }
+    return true;
+}
+
+// Writes the map's entities back out, with comments, enough times to make
+// a lump of a few MiB, and parses it in place and into strings. Returns
+// false if the two disagree.
+static bool runEntities(Map& map)
+{
+    const EntityList& entities = map.getEntities();
+    int spawns = 0;
+    for (int i = entities.find("info_player_deathmatch"); i >= 0; i = entities.find("info_player_deathmatch", i))
+        spawns++;
+    int models = 0;
+    for (int i = 0; i < (int)entities.size(); i++)
+    {
+        glm::vec3 origin;
+        if (entities.model(i) >= 0 && entities.vector(i, "origin", origin))
+            models++;
+    }
+
+    std::string copy;
+    for (std::size_t i = 0; i < entities.size(); i++)
+    {
+        copy += "// entity\n{\n";
+        const EntityPair* pairs = entities.pairs(entities[i]);
+        for (int j = 0; j < entities[i].pairCount; j++)
+        {
+            copy += '"' + std::string(pairs[j].key.data, pairs[j].key.length) + "\" \"";
+            copy += std::string(pairs[j].value.data, pairs[j].value.length) + "\"\n";
+        }
+        copy += "}\n";
+    }
+    std::string text;
+    while (!copy.empty() && text.size() < 4 * 1024 * 1024)
+        text += copy;
+
+    EntityList parsed;
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    bool valid = parsed.parse(text.data(), text.size());
+    std::chrono::duration<double> parseTime = std::chrono::high_resolution_clock::now() - start;
+
+    std::vector<ReferenceEntity> reference;
+    start = std::chrono::high_resolution_clock::now();
+    valid = referenceEntities(text, reference) && valid;
+    std::chrono::duration<double> referenceTime = std::chrono::high_resolution_clock::now() - start;
+
+    valid = valid && parsed.size() == reference.size();
+    for (std::size_t i = 0; valid && i < parsed.size(); i++)
+    {
+        std::size_t unique = 0;
+        const EntityPair* pairs = parsed.pairs(parsed[i]);
+        for (int j = 0; valid && j < parsed[i].pairCount; j++)
+        {
+            std::string key(pairs[j].key.data, pairs[j].key.length);
+            EntityString value = parsed.value(i, key.c_str());
+            ReferenceEntity::const_iterator found = reference[i].find(key);
+            valid = found != reference[i].end() && found->second == std::string(value.data, value.length);
+            unique += value.data == pairs[j].value.data;
+        }
+        valid = valid && unique == reference[i].size();
+    }
+
+    // Cut off inside a quote or a block, the whole lump is rejected rather
+    // than read as the entities before the cut
+    const char* truncated[] = { "\"classname", "{ \"classname\" \"light", "{ \"classname\" \"light\"" };
+    for (std::size_t i = 0; i < sizeof(truncated) / sizeof(truncated[0]); i++)
+    {
+        std::string broken = copy + truncated[i];
+        EntityList rejected;
+        valid = !rejected.parse(broken.data(), broken.size()) && rejected.size() == 0 && valid;
+    }
+
+    double megabytes = text.size() / (1024.0 * 1024.0);
+    std::cout << "entities: " << entities.size() << " entities, " << spawns << " spawn points, " << models
+              << " model origins, " << megabytes / std::max(parseTime.count(), 1e-9) << " MiB/s in place, "
+              << megabytes / std::max(referenceTime.count(), 1e-9) << " MiB/s strings, "
+              << (valid ? "ok" : "FAILED") << std::endl;
+    return valid;
+}
+
+struct Percentiles {
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+// Nearest rank percentiles
+static Percentiles percentiles(std::vector<double> samples)
+{
+    Percentiles result = {0.0, 0.0, 0.0, 0.0, 0.0};
+    if (samples.empty())
+        return result;
+    std::sort(samples.begin(), samples.end());
+    double total = 0.0;
+    for (std::size_t i = 0; i < samples.size(); i++)
+        total += samples[i];
+    std::size_t count = samples.size();
+    result.mean = total / count;
+    result.p50 = samples[std::min((std::size_t)std::ceil(count * 0.50), count) - 1];
+    result.p90 = samples[std::min((std::size_t)std::ceil(count * 0.90), count) - 1];
+    result.p99 = samples[std::min((std::size_t)std::ceil(count * 0.99), count) - 1];
+    result.max = samples.back();
+    return result;
+}
+
+static std::string jsonString(const std::string& value)
+{
+    std::string result = "\"";
+    for (std::size_t i = 0; i < value.size(); i++)
+    {
+        if (value[i] == '"' || value[i] == '\\')
+            result += '\\';
+        if ((unsigned char)value[i] >= 0x20)
+            result += value[i];
+    }
+    return result + "\"";
+}
+
+struct Metric {
+    const char* name;
+    const char* unit;
+    std::vector<double> samples;
+};
+
+// Times each query on its own for every frame of the path, the same calls
+// the viewer makes. Movers trace from the last frame's position with the
+// viewer's radius.
+static void runReplay(Map& map, const std::vector<Camera>& path, const char* mapName, const char* jsonFile)
+{
+    Metric metrics[] = {
+        {"findLeaf", "us", std::vector<double>()},
+        {"cull", "us", std::vector<double>()},
+        {"traceWorld", "us", std::vector<double>()},
+        {"lightVol", "us", std::vector<double>()},
+        {"visibleLeaves", "leaves", std::vector<double>()},
+        {"visibleFaces", "faces", std::vector<double>()}
+    };
+    const int metricCount = sizeof(metrics) / sizeof(metrics[0]);
+
+    RenderPass pass;
+    glm::vec3 previous = path.empty() ? glm::vec3(0.f) : path[0].position;
+    for (std::size_t i = 0; i < path.size(); i++)
+    {
+        glm::vec3 position = path[i].position;
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        volatile int leaf = map.findLeaf(position);
+        (void)leaf;
+        std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+        metrics[0].samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+
+        double faces = 0;
+        start = std::chrono::high_resolution_clock::now();
+        pass.reset(position, cameraMatrix(path[i]));
+        for (int solid = 1; solid >= 0; solid--)
+        {
+            map.cullWorld(pass, solid != 0);
+            faces += pass.visibleFaces.size();
+        }
+        end = std::chrono::high_resolution_clock::now();
+        metrics[1].samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+
+        start = std::chrono::high_resolution_clock::now();
+        map.traceWorld(path[i].move, previous, 10.f);
+        end = std::chrono::high_resolution_clock::now();
+        metrics[2].samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+        previous = position;
+
+        start = std::chrono::high_resolution_clock::now();
+        LightVol light;
+        map.getLightGrid().sample(position, light);
+        volatile float ambient = light.ambient.x;
+        (void)ambient;
+        end = std::chrono::high_resolution_clock::now();
+        metrics[3].samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+
+        metrics[4].samples.push_back(pass.visibleLeaves);
+        metrics[5].samples.push_back(faces);
+        PROFILE_FRAME();
+    }
+
+    for (int i = 0; i < metricCount; i++)
+    {
+        Percentiles result = percentiles(metrics[i].samples);
+        std::cout << "replay " << metrics[i].name << " (" << metrics[i].unit << ")"
+                  << ": mean " << result.mean << ", p50 " << result.p50 << ", p90 " << result.p90
+                  << ", p99 " << result.p99 << ", max " << result.max << std::endl;
+    }
+
+    if (jsonFile == NULL)
+        return;
+    std::ofstream json(jsonFile);
+    if (!json)
+    {
+        std::cout << jsonFile << ": could not open" << std::endl;
+        return;
+    }
+    json.precision(9);
+    json << "{\n";
+    json << "  \"map\": " << jsonString(mapName) << ",\n";
+    json << "  \"frames\": " << path.size() << ",\n";
+    json << "  \"load\": {";
+    const std::vector<LoadStage>& stages = map.getLoadStages();
+    double total = 0.0;
+    for (std::size_t i = 0; i < stages.size(); i++)
+    {
+        json << (i > 0 ? ", " : "") << jsonString(stages[i].name) << ": " << stages[i].milliseconds;
+        total += stages[i].milliseconds;
+    }
+    json << (stages.empty() ? "" : ", ") << "\"total\": " << total << "},\n";
+    json << "  \"metrics\": {\n";
+    for (int i = 0; i < metricCount; i++)
+    {
+        Percentiles result = percentiles(metrics[i].samples);
+        json << "    " << jsonString(metrics[i].name) << ": {"
+             << "\"unit\": " << jsonString(metrics[i].unit)
+             << ", \"mean\": " << result.mean
+             << ", \"p50\": " << result.p50
+             << ", \"p90\": " << result.p90
+             << ", \"p99\": " << result.p99
+             << ", \"max\": " << result.max << "}"
+             << (i + 1 < metricCount ? "," : "") << "\n";
+    }
+    json << "  }\n";
+    json << "}\n";
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<const char*> args;
+    const char* pathFile = NULL;
+    const char* jsonFile = NULL;
+    const char* traceFile = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-path") == 0 && i + 1 < argc)
+            pathFile = argv[++i];
+        else if (strcmp(argv[i], "-json") == 0 && i + 1 < argc)
+            jsonFile = argv[++i];
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+            traceFile = argv[++i];
+        else
+            args.push_back(argv[i]);
+    }
+    if (args.size() < 2 || args.size() > 3)
+    {
+        std::cout << "Usage: bspbench Q3DataPath Map [Frames] [-path File] [-json File] [-trace File]" << std::endl;
+        return -1;
+    }
+    int frames = args.size() > 2 ? atoi(args[2]) : 2000;
+
+    PHYSFS_init(argv[0]);
+
+    if (!PHYSFS_mount(args[0], NULL, 0))
+    {
+        std::cout << "Path not found" << std::endl;
+        return -1;
+    }
+
+    char** files = PHYSFS_enumerateFiles("/");
+    for (char** i = files; *i != NULL; i++)
+    {
+        std::string file(*i);
+        if (file.length() > 4 && file.substr(file.length() - 4) == ".pk3")
+        {
+            std::string dirsep = PHYSFS_getDirSeparator();
+            std::string path = PHYSFS_getRealDir(file.c_str());
+            if (path.length() > 1 && path.substr(path.length() - 1) != dirsep)
+                path.append(dirsep);
+            path.append(file);
+            PHYSFS_mount(path.c_str(), NULL, 0);
+        }
+    }
+    PHYSFS_freeList(files);
+
+    ThreadPool pool;
+
+    Map map;
+    if (!map.load(args[1], &pool))
+    {
+        return -1;
+    }
+    PROFILE_END_LOAD();
+
+    const std::vector<LoadStage>& stages = map.getLoadStages();
+    for (std::size_t i = 0; i < stages.size(); i++)
+        std::cout << "load " << stages[i].name << ": " << stages[i].milliseconds << " ms" << std::endl;
+
+    std::vector<Camera> path;
+    if (pathFile)
+    {
+        if (!loadPath(pathFile, path))
+            return -1;
+    }
+    else
+    {
+        path = makePath(map, frames, 1);
+    }
+
+#ifdef BSP_PROFILE
+    Profiler::instance().setFrameLimit(path.size());
+#endif
+    runReplay(map, path, args[1], jsonFile);
+    if (traceFile)
+    {
+#ifdef BSP_PROFILE
+        Profiler::instance().writeChromeTrace(traceFile);
+#else
+        std::cout << "-trace needs a build with BSP_PROFILE" << std::endl;
+#endif
+    }
+
+    runCulling(map, path, "cull all planes", false, 0.f);
+    runCulling(map, path, "cull plane masks", true, 0.f);
+    runCulling(map, path, "cull patch lod", true, 2.f);
+
+    // The solid pass takes the per cluster face lists instead of the tree
+    map.setClusterCache(16 * 1024 * 1024);
+    runCulling(map, path, "cull cluster cache", true, 0.f);
+    map.setClusterCache(0);
+
+    bool passed = runNodes(map, path);
+    passed = runPlanes(map, path) && passed;
+
+    passed = runVertexFormats(map) && passed;
+    passed = runLightMapAtlas() && passed;
+    passed = runTesselation(pool) && passed;
+    passed = runTraces(map, std::max(frames / 10, 1)) && passed;
+    passed = runSlopedPush() && passed;
+    passed = runAllocations(map, path) && passed;
+    passed = runSweeps(map, std::max(frames * 10, 100)) && passed;
+    passed = runLightGrid(map, std::max(frames * 100, 100) + 3) && passed;
+    passed = runEntities(map) && passed;
+
+    return passed ? 0 : 1;
+}
@@ -1,11 +1,19 @@
-#include <cmath>
-#include <cstddef>
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
-#include <glm/gtc/matrix_transform.hpp>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BSP_SSE2
+#include <emmintrin.h>
+#endif
 #include <physfs.h>
-#include "filestream.hpp"
 #include "bsp.hpp"
+#include "mapcache.hpp"
+#include "profiler.hpp"
+#include "tesselator.hpp"
 
 enum
 {
@@ -25,60 +33,10 @@ enum
     FACE,
     LIGHTMAP,
     LIGHTVOL,
-    VISDATA
+    VISDATA,
+    LUMPCOUNT
 };
 
-const int CONTENTS_SOLID        = 0x1;
-const int CONTENTS_LAVA         = 0x8;
-const int CONTENTS_SLIME        = 0x10;
-const int CONTENTS_WATER        = 0x20;
-const int CONTENTS_FOG          = 0x40;
-const int CONTENTS_NOTTEAM1     = 0x80;
-const int CONTENTS_NOTTEAM2     = 0x100;
-const int CONTENTS_NOBOTCLIP    = 0x200;
-const int CONTENTS_AREAPORTAL   = 0x8000;
-const int CONTENTS_PLAYERCLIP   = 0x10000;
-const int CONTENTS_MONSTERCLIP  = 0x20000;
-const int CONTENTS_TELEPORTER   = 0x40000;
-const int CONTENTS_JUMPPAD      = 0x80000;
-const int CONTENTS_CLUSTERPORTAL= 0x100000;
-const int CONTENTS_DONOTENTER   = 0x200000;
-const int CONTENTS_BOTCLIP      = 0x400000;
-const int CONTENTS_MOVER        = 0x800000;
-const int CONTENTS_ORIGIN       = 0x1000000;
-const int CONTENTS_BODY         = 0x2000000;
-const int CONTENTS_CORPSE       = 0x4000000;
-const int CONTENTS_DETAIL       = 0x8000000;
-const int CONTENTS_STRUCTURAL   = 0x10000000;
-const int CONTENTS_TRANSLUCENT  = 0x20000000;
-const int CONTENTS_TRIGGER      = 0x40000000;
-const int CONTENTS_NODROP       = 0x80000000;
-
-const int SURF_NODAMAGE     = 0x1;
-const int SURF_SLICK        = 0x2;
-const int SURF_SKY          = 0x4;
-const int SURF_LADDER       = 0x8;
-const int SURF_NOIMPACT     = 0x10;
-const int SURF_NOMARKS      = 0x20;
-const int SURF_FLESH        = 0x40;
-const int SURF_NODRAW       = 0x80;
-const int SURF_HINT         = 0x100;
-const int SURF_SKIP         = 0x200;
-const int SURF_NOLIGHTMAP   = 0x400;
-const int SURF_POINTLIGHT   = 0x800;
-const int SURF_METALSTEPS   = 0x1000;
-const int SURF_NOSTEPS      = 0x2000;
-const int SURF_NONSOLID     = 0x4000;
-const int SURF_LIGHTFILTER  = 0x8000;
-const int SURF_ALPHASHADOW  = 0x10000;
-const int SURF_NODLIGHT     = 0x20000;
-const int SURF_SURFDUST     = 0x40000;
-
-const void* VertexPosition = (void*)(long)offsetof(Vertex, position);
-const void* VertexTexCoord = (void*)(long)offsetof(Vertex, texCoord);
-const void* VertexLMCoord = (void*)(long)offsetof(Vertex, lmCoord);
-const void* VertexNormalCoord = (void*)(long)offsetof(Vertex, normal);
-
 struct Lump
 {
     int offset;
@@ -89,7 +47,7 @@ struct Header
 {
     char magic[4];
     int version;
-    Lump lumps[17];
+    Lump lumps[LUMPCOUNT];
 };
 
 struct RawShader
@@ -117,199 +75,266 @@ struct RawFace
     int size[2];
 };
 
-struct RawLightVol
+struct RawLightMap
 {
-    unsigned char ambient[3];
-    unsigned char directional[3];
-    unsigned char direction[2];
+    unsigned char data[128 * 128 * 3];
 };
 
-Vertex operator+(const Vertex& v1, const Vertex& v2)
+// Triangles of one patch tesselated into a (level + 1) x (level + 1) grid
+static void patchIndices(unsigned int* indices, int level, unsigned int vOffset)
 {
-    Vertex temp;
-    temp.position = v1.position + v2.position;
-    temp.texCoord = v1.texCoord + v2.texCoord;
-    temp.lmCoord = v1.lmCoord + v2.lmCoord;
-    temp.normal = v1.normal + v2.normal;
-    return temp;
+    int L1 = level + 1;
+    for (int i = 0; i < level; ++i)
+    {
+        for (int j = 0; j < level; ++j)
+        {
+            int offset = (i * level + j) * 6;
+            indices[offset + 0] = (i    ) * L1 + (j    ) + vOffset;
+            indices[offset + 1] = (i    ) * L1 + (j + 1) + vOffset;
+            indices[offset + 2] = (i + 1) * L1 + (j + 1) + vOffset;
+
+            indices[offset + 3] = (i + 1) * L1 + (j + 1) + vOffset;
+            indices[offset + 4] = (i + 1) * L1 + (j    ) + vOffset;
+            indices[offset + 5] = (i    ) * L1 + (j    ) + vOffset;
+        }
+    }
 }
 
-Vertex operator*(const Vertex& v1, const float& d)
+RenderPass::RenderPass()
+    : pos(0.f)
+    , frutsum(glm::mat4(1.f))
+    , cluster(-1)
+    , planeMasks(true)
+    , patchTolerance(0.f)
+    , patchScale(1.f)
+    , boxTests(0)
+    , planeTests(0)
+    , visibleLeaves(0)
 {
-    Vertex temp;
-    temp.position = v1.position * d;
-    temp.texCoord = v1.texCoord * d;
-    temp.lmCoord = v1.lmCoord * d;
-    temp.normal = v1.normal * d;
-    return temp;
 }
 
-void Map::tesselate(int controlOffset, int controlWidth, int vOffset, int iOffset)
+RenderPass::RenderPass(const glm::vec3& position, const glm::mat4& matrix)
+    : pos(position)
+    , frutsum(matrix)
+    , cluster(-1)
+    , planeMasks(true)
+    , patchTolerance(0.f)
+    , patchScale(glm::length(glm::vec3(matrix[0][1], matrix[1][1], matrix[2][1])))
+    , boxTests(0)
+    , planeTests(0)
+    , visibleLeaves(0)
 {
-    Vertex controls[9];
-    int cIndex = 0;
-    for (int c = 0; c < 3; c++)
-    {
-        int pos = c * controlWidth;
-        controls[cIndex++] = vertexArray[controlOffset + pos];
-        controls[cIndex++] = vertexArray[controlOffset + pos + 1];
-        controls[cIndex++] = vertexArray[controlOffset + pos + 2];
-    }
+}
 
-    int L1 = bezierLevel + 1;
+void RenderPass::reset(const glm::vec3& position, const glm::mat4& matrix)
+{
+    pos = position;
+    frutsum = Frutsum(matrix);
+    cluster = -1;
+    // The y scale of the projection, the view only rotates and moves
+    patchScale = glm::length(glm::vec3(matrix[0][1], matrix[1][1], matrix[2][1]));
+    boxTests = 0;
+    planeTests = 0;
+    visibleLeaves = 0;
+}
 
-    for (int j = 0; j <= bezierLevel; ++j)
-    {
-        float a = (float)j / bezierLevel;
-        float b = 1.f - a;
-        vertexArray[vOffset + j] = controls[0] * b * b + controls[3] * 2 * b * a + controls[6] * a * a;
-    }
+DrawList::DrawList()
+    : faces(0)
+    , triangles(0)
+    , stateChanges(0)
+{
+}
 
-    for (int i = 1; i <= bezierLevel; ++i)
-    {
-        float a = (float)i / bezierLevel;
-        float b = 1.f - a;
+void DrawList::clear()
+{
+    batches.clear();
+    rangeOffsets.clear();
+    rangeCounts.clear();
+    faces = 0;
+    triangles = 0;
+    stateChanges = 0;
+}
 
-        Vertex temp[3];
+TracePass::TracePass()
+    : position(0.f)
+    , oldPosition(0.f)
+    , radius(0.f)
+    , brushBounds(true)
+    , brushTests(0)
+    , sideTests(0)
+{
+}
 
-        for (int j = 0; j < 3; ++j)
-        {
-            int k = 3 * j;
-            temp[j] = controls[k + 0] * b * b + controls[k + 1] * 2 * b * a + controls[k + 2] * a * a;
-        }
+void TracePass::reset(const glm::vec3& pos, const glm::vec3& oldPos, float rad)
+{
+    position = pos;
+    oldPosition = oldPos;
+    radius = rad;
+    brushTests = 0;
+    sideTests = 0;
+}
 
-        for (int j = 0; j <= bezierLevel; ++j)
-        {
-            float a = (float)j / bezierLevel;
-            float b = 1.f - a;
+SweepPass::SweepPass()
+    : start(0.f)
+    , end(0.f)
+    , extents(0.f)
+    , radius(0.f)
+    , contentMask(0)
+    , brushBounds(true)
+    , brushTests(0)
+    , sideTests(0)
+{
+}
 
-            vertexArray[vOffset + i * L1 + j] = temp[0] * b * b + temp[1] * 2 * b * a + temp[2] * a * a;
-        }
-    }
+void SweepPass::reset(const glm::vec3& from, const glm::vec3& to, const glm::vec3& halfSize, float rad, int mask)
+{
+    start = from;
+    end = to;
+    extents = halfSize;
+    radius = rad;
+    contentMask = mask;
+    result.fraction = 1.f;
+    result.end = to;
+    result.plane.normal = glm::vec3(0.f);
+    result.plane.distance = 0.f;
+    result.brush = -1;
+    result.contents = 0;
+    result.surface = 0;
+    result.startSolid = false;
+    result.allSolid = false;
+    brushTests = 0;
+    sideTests = 0;
+}
+
+Map::Map()
+    : bezierLevel(3)
+    , lightMapAtlasSize(2048)
+    , axialPlanes(true)
+    , flatNodes(true)
+    , clusterCacheEager(false)
+{
+}
 
-    for (int i = 0; i <= bezierLevel; ++i)
+template <typename T>
+static void mapLump(const MappedFile& file, const Lump& lump, LumpArray<T>& array)
+{
+    const char* data = file.data() + lump.offset;
+    std::size_t count = lump.size / sizeof(T);
+    if (reinterpret_cast<std::uintptr_t>(data) % alignof(T) == 0)
+        array.assign(reinterpret_cast<const T*>(data), count);
+    else
+        array.copy(data, count);
+}
+
+// Faces pick the ranges the load stages write to, so each has to stay
+// inside its lumps. Index ranges may not overlap either, they are rebased
+// in place by whichever task handles their face. Returns the first bad
+// face, or -1.
+static int findInvalidFace(const LumpArray<RawFace>& faces, const char* meshVertices, int meshVertexCount, int vertexCount,
+                           int lightMapCount, int bezierPatchSize, int bezierIndexSize)
+{
+    const std::int64_t limit = 0x7fffffff;
+    std::int64_t patchVertices = vertexCount;
+    std::int64_t patchIndices = meshVertexCount;
+    std::vector<char> used(meshVertexCount, 0);
+    for (std::size_t i = 0; i < faces.size(); i++)
     {
-        for (int j = 0; j <= bezierLevel; ++j)
+        const RawFace& face = faces[i];
+        if (face.vertexOffset < 0 || face.vertexCount < 0 || (std::int64_t)face.vertexOffset + face.vertexCount > vertexCount)
+            return (int)i;
+        if (face.lightMap >= lightMapCount)
+            return (int)i;
+
+        if (face.type == 2)
         {
-            int offset = iOffset + (i * bezierLevel + j) * 6;
-            meshIndexArray[offset + 0] = (i    ) * L1 + (j    ) + vOffset;
-            meshIndexArray[offset + 1] = (i    ) * L1 + (j + 1) + vOffset;
-            meshIndexArray[offset + 2] = (i + 1) * L1 + (j + 1) + vOffset;
+            if (face.size[0] < 3 || face.size[1] < 3 || (std::int64_t)face.size[0] * face.size[1] > face.vertexCount)
+                return (int)i;
+            std::int64_t patches = (std::int64_t)((face.size[0] - 1) / 2) * ((face.size[1] - 1) / 2);
+            patchVertices += patches * bezierPatchSize;
+            patchIndices += patches * bezierIndexSize;
+            if (patchVertices > limit || patchIndices > limit)
+                return (int)i;
+            continue;
+        }
 
-            meshIndexArray[offset + 3] = (i + 1) * L1 + (j + 1) + vOffset;
-            meshIndexArray[offset + 4] = (i + 1) * L1 + (j    ) + vOffset;
-            meshIndexArray[offset + 5] = (i    ) * L1 + (j    ) + vOffset;
+        if (face.meshVertexOffset < 0 || face.meshVertexCount < 0 || (std::int64_t)face.meshVertexOffset + face.meshVertexCount > meshVertexCount)
+            return (int)i;
+        for (int j = face.meshVertexOffset; j < face.meshVertexOffset + face.meshVertexCount; j++)
+        {
+            unsigned int index;
+            memcpy(&index, meshVertices + (std::size_t)j * sizeof(unsigned int), sizeof(unsigned int));
+            if (used[j] || index >= (unsigned int)face.vertexCount)
+                return (int)i;
+            used[j] = 1;
         }
     }
+    return -1;
 }
 
-#include "shaders.inc"
-
-RenderPass::RenderPass(Map* parent, const glm::vec3& position, const glm::mat4& matrix)
-    : pos(position)
-    , frutsum(matrix)
+void Map::setCacheDirectory(const std::string& directory)
 {
-    renderedFaces.resize(parent->faceArray.size(), false);
+    cacheDirectory = directory;
 }
 
-TracePass::TracePass(Map* parent, const glm::vec3& pos, const glm::vec3 &oldPos, float rad)
-    : position(pos)
-    , oldPosition(oldPos)
-    , radius(rad)
+// Largest side of a lightmap atlas page in pixels, usually the smaller of
+// 2048 and GL_MAX_TEXTURE_SIZE
+void Map::setLightMapAtlasSize(int size)
 {
-    tracedBrushes.resize(parent->brushArray.size(), false);
+    lightMapAtlasSize = size;
 }
 
-Map::Map()
-    : program(0)
-    , vertexBuffer(0)
-    , meshIndexBuffer(0)
-    , bezierLevel(3)
-{
-    glGenBuffers(1, &vertexBuffer);
-    glGenBuffers(1, &meshIndexBuffer);
-
-    GLint status;
-
-    GLuint vertShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertShader, 1, &vertSrc, NULL);
-    glCompileShader(vertShader);
-    glGetShaderiv(vertShader, GL_COMPILE_STATUS, &status);
-    if (status == GL_FALSE)
-    {
-        GLint length;
-        glGetShaderiv(vertShader, GL_INFO_LOG_LENGTH, &length);
-        char* log = new char[length + 1];
-        log[length] = '\0';
-        glGetShaderInfoLog(vertShader, length, &length, log);
-        std::cout << log << std::endl;
-        delete[] log;
-        return;
-    }
-
-    GLuint fragShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragShader, 1, &fragSrc, NULL);
-    glCompileShader(fragShader);
-    glGetShaderiv(fragShader, GL_COMPILE_STATUS, &status);
-    if (status == GL_FALSE)
-    {
-        GLint length;
-        glGetShaderiv(fragShader, GL_INFO_LOG_LENGTH, &length);
-        char* log = new char[length + 1];
-        log[length] = '\0';
-        glGetShaderInfoLog(fragShader, length, &length, log);
-        std::cout << log << std::endl;
-        glDeleteShader(vertShader);
-        delete[] log;
-        return;
-    }
-
-    program = glCreateProgram();
-    glAttachShader(program, vertShader);
-    glAttachShader(program, fragShader);
-
-    glBindAttribLocation(program, 0, "vertex");
-    //glBindAttribLocation(program, 1, "normal");
-    glBindAttribLocation(program, 2, "texcoord");
-    glBindAttribLocation(program, 3, "lmcoord");
-
-    glLinkProgram(program);
-
-    glDeleteShader(vertShader);
-    glDeleteShader(fragShader);
+// Walks the tree through the file's own node and plane records when off,
+// which only exists to compare the two
+void Map::setFlatNodes(bool enabled)
+{
+    flatNodes = enabled;
+}
 
-    glGetProgramiv(program, GL_LINK_STATUS, &status);
-    if (status == GL_FALSE)
-    {
-        GLint length;
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
-        char* log = new char[length + 1];
-        log[length] = '\0';
-        glGetProgramInfoLog(program, length, &length, log);
-        std::cout << log << std::endl;
-        delete[] log;
-        return;
-    }
+// Tests every plane with a full dot product when off, which only exists to
+// check the axial fast path against it
+void Map::setAxialPlanes(bool enabled)
+{
+    axialPlanes = enabled;
+    preparePlanes();
+    for (std::size_t i = 0; i < flatNodeArray.size(); i++)
+        flatNodeArray[i].type = typedPlaneArray[flatNodeArray[i].plane].type;
+}
 
-    programLoc["matrix"] = glGetUniformLocation(program, "matrix");
-    programLoc["texture"] = glGetUniformLocation(program, "texture");
-    programLoc["lightmap"] = glGetUniformLocation(program, "lightmap");
+// A limit of zero, the default, turns the per cluster face lists off. They
+// skip the tree walk for the solid pass, so leaf statistics and the node
+// and leaf counters are only filled in without them.
+void Map::setClusterCache(std::size_t limit, bool eager)
+{
+    clusterCache.setLimit(limit);
+    clusterCacheEager = eager;
 }
 
-bool Map::load(std::string filename)
+bool Map::load(std::string filename, ThreadPool* pool)
 {
-    glEnable(GL_TEXTURE_2D);
+    PROFILE_ZONE("Map::load");
+    loadStages.clear();
+    std::chrono::steady_clock::time_point stageStart = std::chrono::steady_clock::now();
+    auto endStage = [&](const char* name)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        LoadStage stage = {name, std::chrono::duration<double, std::milli>(now - stageStart).count()};
+        loadStages.push_back(stage);
+        stageStart = now;
+    };
 
-    PHYSFS_File* file = PHYSFS_openRead(filename.c_str());
-    if (!file)
+    if (!file.open(filename))
     {
         std::cout << filename.c_str() << ": " << PHYSFS_getLastError() << std::endl;
         return false;
     }
 
-    PHYSFS_seek(file, 0);
     Header header;
-    PHYSFS_read(file, &header, sizeof(Header), 1);
+    if (file.size() < sizeof(Header))
+    {
+        std::cout << "Invalid file" << std::endl;
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(Header));
     if (std::string(header.magic, 4) != "IBSP")
     {
         std::cout << "Invalid file" << std::endl;
@@ -320,318 +345,953 @@ bool Map::load(std::string filename)
         std::cout << "File version not supported" << std::endl;
         return false;
     }
+    for (int i = 0; i < LUMPCOUNT; i++)
+    {
+        const Lump& lump = header.lumps[i];
+        if (lump.offset < 0 || lump.size < 0 || (std::size_t)lump.offset + lump.size > file.size())
+        {
+            std::cout << "Invalid lump " << i << std::endl;
+            return false;
+        }
+    }
 
-    PHYSFS_seek(file, header.lumps[ENTITY].offset);
-    std::string rawEntity;
-    rawEntity.resize(header.lumps[ENTITY].size);
-    PHYSFS_read(file, &rawEntity[0], 1, header.lumps[ENTITY].size);
-
-    int shaderCount = header.lumps[SHADER].size / sizeof(RawShader);
-    PHYSFS_seek(file, header.lumps[SHADER].offset);
-    shaderArray.reserve(shaderCount);
-    for (int i = 0; i < shaderCount; i++)
-    {
-        RawShader rawshader;
-        PHYSFS_read(file, &rawshader, sizeof(RawShader), 1);
-        rawshader.name[63] = '\0';
-        Shader shader;
-        shader.render = true;
-        shader.transparent = false;
-        shader.solid = true;
-        shader.name = std::string(rawshader.name);
-        if (rawshader.surface & SURF_NONSOLID) shader.solid = false;
-        if (rawshader.contents & CONTENTS_PLAYERCLIP) shader.solid = true;
-        if (rawshader.contents & CONTENTS_TRANSLUCENT) shader.transparent = true;
-        if (rawshader.contents & CONTENTS_LAVA) shader.render = false;
-        if (rawshader.contents & CONTENTS_SLIME) shader.render = false;
-        if (rawshader.contents & CONTENTS_WATER) shader.render = false;
-        if (rawshader.contents & CONTENTS_FOG) shader.render = false;
-        if (shader.name == "noshader") shader.render = false;
-        if (shader.render)
-        {
-            if (PHYSFS_exists(std::string(shader.name + ".jpg").c_str()))
-            {
-                shader.name += ".jpg";
-            }
-            else if (PHYSFS_exists(std::string(shader.name + ".tga").c_str()))
+    int visCount = 0;
+    const unsigned char* rawVisData = NULL;
+    visData.clusterCount = 0;
+    visData.bytesPerCluster = 0;
+    visData.wordsPerCluster = 0;
+    if (header.lumps[VISDATA].size >= 8)
+    {
+        const char* rawVisLump = file.data() + header.lumps[VISDATA].offset;
+        memcpy(&visData.clusterCount, rawVisLump, sizeof(int));
+        memcpy(&visData.bytesPerCluster, rawVisLump + sizeof(int), sizeof(int));
+        if (visData.clusterCount < 0 || visData.bytesPerCluster < 0
+            || (std::int64_t)visData.clusterCount * visData.bytesPerCluster > header.lumps[VISDATA].size - 8)
+        {
+            std::cout << "Invalid visdata" << std::endl;
+            return false;
+        }
+        visCount = visData.clusterCount * visData.bytesPerCluster;
+        rawVisData = (const unsigned char*)rawVisLump + 8;
+        visData.wordsPerCluster = VisData::wordsFor(visData.bytesPerCluster);
+    }
+
+    if (!entities.parse(file.data() + header.lumps[ENTITY].offset, header.lumps[ENTITY].size))
+        std::cout << "Invalid entity lump, ignoring it" << std::endl;
+
+    LumpArray<RawShader> rawShaderArray;
+    LumpArray<RawFace> rawFaceArray;
+    LumpArray<RawLightMap> rawLightMapArray;
+    mapLump(file, header.lumps[SHADER], rawShaderArray);
+    mapLump(file, header.lumps[FACE], rawFaceArray);
+    mapLump(file, header.lumps[LIGHTMAP], rawLightMapArray);
+
+    mapLump(file, header.lumps[PLANE], planeArray);
+    mapLump(file, header.lumps[NODE], nodeArray);
+    mapLump(file, header.lumps[LEAF], leafArray);
+    mapLump(file, header.lumps[LEAFFACE], leafFaceArray);
+    mapLump(file, header.lumps[LEAFBRUSH], leafBrushArray);
+    mapLump(file, header.lumps[MODEL], modelArray);
+    mapLump(file, header.lumps[BRUSH], brushArray);
+    mapLump(file, header.lumps[BRUSHSIDE], brushSideArray);
+    mapLump(file, header.lumps[EFFECT], effectArray);
+    mapLump(file, header.lumps[LIGHTVOL], lightVolArray);
+
+    int faceCount = rawFaceArray.size();
+    int lightMapCount = rawLightMapArray.size();
+    int meshVertexCount = header.lumps[MESHVERTEX].size / sizeof(unsigned int);
+    int vertexCount = header.lumps[VERTEX].size / sizeof(Vertex);
+    int bezierPatchSize = (bezierLevel + 1) * (bezierLevel + 1);
+    int bezierIndexSize = bezierLevel * bezierLevel * 6;
+    std::vector<int> patchVertexOffset(faceCount);
+    lightMapAtlas.build(lightMapCount, lightMapAtlasSize);
+
+    std::vector<Face> faces;
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<LightMap> lightMaps;
+    std::vector<std::uint64_t> visWords;
+
+    Tesselator tesselator(bezierLevel);
+
+    // Stages only touch their own outputs, so anything without an arrow
+    // between them can run at the same time
+    TaskGraph graph;
+
+    graph.add([&]()
+    {
+        PROFILE_ZONE("shaders");
+        shaderArray.clear();
+        shaderArray.reserve(rawShaderArray.size());
+        for (std::size_t i = 0; i < rawShaderArray.size(); i++)
+        {
+            const RawShader& rawshader = rawShaderArray[i];
+            Shader shader;
+            shader.render = true;
+            shader.transparent = false;
+            shader.solid = true;
+            shader.surface = rawshader.surface;
+            shader.contents = rawshader.contents;
+            shader.name = std::string(rawshader.name, std::find(rawshader.name, rawshader.name + 63, '\0'));
+            if (rawshader.surface & SURF_NONSOLID) shader.solid = false;
+            if (rawshader.contents & CONTENTS_PLAYERCLIP) shader.solid = true;
+            if (rawshader.contents & CONTENTS_TRANSLUCENT) shader.transparent = true;
+            if (rawshader.contents & CONTENTS_LAVA) shader.render = false;
+            if (rawshader.contents & CONTENTS_SLIME) shader.render = false;
+            if (rawshader.contents & CONTENTS_WATER) shader.render = false;
+            if (rawshader.contents & CONTENTS_FOG) shader.render = false;
+            if (shader.name == "noshader") shader.render = false;
+            shaderArray.push_back(shader);
+        }
+    });
+
+    endStage("lumps");
+
+    // Everything below only depends on the file contents and bezierLevel,
+    // so it can come straight from the cache
+    std::uint64_t hash = 0;
+    bool cached = false;
+    if (!cacheDirectory.empty())
+    {
+        hash = hashData(file.data(), file.size());
+        cached = loadCache(hash, faceCount, lightMapCount);
+        endStage("cache");
+    }
+
+    if (!cached)
+    {
+        int invalidFace = findInvalidFace(rawFaceArray, file.data() + header.lumps[MESHVERTEX].offset, meshVertexCount,
+                                          vertexCount, lightMapCount, bezierPatchSize, bezierIndexSize);
+        if (invalidFace >= 0)
+        {
+            std::cout << "Invalid face " << invalidFace << std::endl;
+            return false;
+        }
+
+        // Face records decide where each tesselated patch goes
+        TaskGraph::Task faceStage = graph.add([&]()
+        {
+            PROFILE_ZONE("faces");
+            int vOffset = vertexCount;
+            int iOffset = meshVertexCount;
+            faces.resize(faceCount);
+            for (int i = 0; i < faceCount; i++)
             {
-                shader.name += ".tga";
+                const RawFace& rawFace = rawFaceArray[i];
+                Face &face = faces[i];
+                face.shader = rawFace.shader;
+                face.effect = rawFace.effect;
+                face.vertexOffset = rawFace.vertexOffset;
+                face.vertexCount = rawFace.vertexCount;
+                face.meshIndexOffset = rawFace.meshVertexOffset;
+                face.meshIndexCount = rawFace.meshVertexCount;
+                face.lightMap = rawFace.lightMap;
+                if (rawFace.lightMap < 0)
+                    face.lightMap = lightMapCount;
+                switch (rawFace.type)
+                {
+                case 1:
+                    face.type = Face::Brush;
+                    break;
+                case 2:
+                    face.type = Face::Bezier;
+                    break;
+                case 3:
+                    face.type = Face::Model;
+                    break;
+                default:
+                    face.type = Face::None;
+                    break;
+                }
+
+                if (face.type == Face::Bezier)
+                {
+                    face.bezierSize[0] = rawFace.size[0];
+                    face.bezierSize[1] = rawFace.size[1];
+                    int dimX = (face.bezierSize[0] - 1) / 2;
+                    int dimY = (face.bezierSize[1] - 1) / 2;
+                    int size = dimX * dimY;
+
+                    patchVertexOffset[i] = vOffset;
+                    face.meshIndexOffset = iOffset;
+                    face.meshIndexCount = size * bezierIndexSize;
+                    vOffset += size * bezierPatchSize;
+                    iOffset += size * bezierIndexSize;
+                }
             }
-            if ((rawshader.surface & 0x80) == 0)
+
+            indices.resize(iOffset);
+            if (meshVertexCount > 0)
+                memcpy(&indices[0], file.data() + header.lumps[MESHVERTEX].offset, meshVertexCount * sizeof(unsigned int));
+
+            vertices.resize(vOffset);
+            if (vertexCount > 0)
+                memcpy(&vertices[0], file.data() + header.lumps[VERTEX].offset, vertexCount * sizeof(Vertex));
+        });
+
+        // Each chunk of faces gathers its patches and evaluates them together
+        TaskGraph::Task tesselateStage = graph.addRange(faceCount, 256, [&](int begin, int end)
+        {
+            PROFILE_ZONE("tesselate");
+            std::vector<PatchJob> jobs;
+            for (int i = begin; i < end; i++)
             {
-                FileStream filestream(shader.name);
-                if (filestream.isOpen())
+                Face &face = faces[i];
+                if (face.type == Face::Bezier)
                 {
-                    if (shader.texture.loadFromStream(filestream))
+                    int dimX = (face.bezierSize[0] - 1) / 2;
+                    int dimY = (face.bezierSize[1] - 1) / 2;
+                    int vOffset = patchVertexOffset[i];
+                    int iOffset = face.meshIndexOffset;
+                    if (face.vertexOffset < 0 || face.vertexOffset + face.bezierSize[0] * face.bezierSize[1] > vertexCount)
+                        continue;
+
+                    for (int x = 0, n = 0; n < dimX; n++, x = 2 * n)
                     {
-                        shader.render = true;
-#if SFML_VERSION_MAJOR > 2 || (SFML_VERSION_MAJOR == 2 && SFML_VERSION_MINOR >= 4)
-                        shader.texture.generateMipmap();
-#endif
-                        shader.texture.setRepeated(true);
-                        shader.texture.setSmooth(true);
+                        for (int y = 0, m = 0; m < dimY; m++, y = 2 * m)
+                        {
+                            PatchJob job;
+                            job.controls = &vertices[face.vertexOffset + x + face.bezierSize[0] * y];
+                            job.controlWidth = face.bezierSize[0];
+                            job.out = &vertices[vOffset];
+                            job.rowStride = bezierLevel + 1;
+                            jobs.push_back(job);
+                            patchIndices(&indices[iOffset], bezierLevel, vOffset);
+                            vOffset += bezierPatchSize;
+                            iOffset += bezierIndexSize;
+                        }
                     }
                 }
                 else
                 {
-                    std::cout << shader.name << ": Texture not found" << std::endl;
+                    for (int j = 0; j < face.meshIndexCount; j++)
+                    {
+                        indices[face.meshIndexOffset + j] += face.vertexOffset;
+                    }
                 }
             }
+            if (!jobs.empty())
+                tesselator.run(&jobs[0], jobs.size());
+        }, std::vector<TaskGraph::Task>(1, faceStage));
+
+        // Moves lightmap coordinates into atlas space. Done once per vertex
+        // in case faces share vertices.
+        graph.add([&]()
+        {
+            PROFILE_ZONE("lightmap coords");
+            std::vector<char> remapped(vertices.size(), 0);
+            for (int i = 0; i < faceCount; i++)
+            {
+                const Face& face = faces[i];
+                int first = face.vertexOffset;
+                int count = face.vertexCount;
+                if (face.type == Face::Bezier)
+                {
+                    first = patchVertexOffset[i];
+                    count = (face.bezierSize[0] - 1) / 2 * ((face.bezierSize[1] - 1) / 2) * bezierPatchSize;
+                }
+                if (first < 0 || count < 0 || (std::size_t)first + count > vertices.size())
+                    continue;
+
+                for (int j = first; j < first + count; j++)
+                {
+                    if (remapped[j])
+                        continue;
+                    remapped[j] = 1;
+                    vertices[j].lmCoord = lightMapAtlas.remap(face.lightMap, vertices[j].lmCoord);
+                }
+            }
+        }, tesselateStage);
+
+        lightMaps.resize(lightMapCount);
+        graph.addRange(lightMapCount, 16, [&](int begin, int end)
+        {
+            PROFILE_ZONE("lightmaps");
+            for (int i = begin; i < end; i++)
+            {
+                const unsigned char* data = rawLightMapArray[i].data;
+                unsigned char* rawLightMap = lightMaps[i].data;
+                for (int j = 0; j < 128 * 128; j++)
+                {
+                    rawLightMap[j * 4 + 0] = data[j * 3 + 0];
+                    rawLightMap[j * 4 + 1] = data[j * 3 + 1];
+                    rawLightMap[j * 4 + 2] = data[j * 3 + 2];
+                    rawLightMap[j * 4 + 3] = 255;
+                }
+            }
+        }, std::vector<TaskGraph::Task>());
+
+        if (visCount > 0)
+            visWords.resize((std::size_t)visData.clusterCount * visData.wordsPerCluster);
+        graph.addRange(visCount > 0 ? visData.clusterCount : 0, 1024, [&](int begin, int end)
+        {
+            PROFILE_ZONE("visdata");
+            VisData::unpack(rawVisData, visData.bytesPerCluster, visData.wordsPerCluster, &visWords[0], begin, end);
+        }, std::vector<TaskGraph::Task>());
+    }
+
+    graph.run(pool);
+
+    if (!cached)
+    {
+        faceArray.take(faces);
+        vertexArray.take(vertices);
+        meshIndexArray.take(indices);
+        lightMapArray.take(lightMaps);
+        visData.words.take(visWords);
+    }
+
+    endStage("decode");
+
+    lightGrid = LightGrid();
+    if (modelArray.size() > 0 && lightVolArray.size() > 0)
+    {
+        if (!lightGrid.build(modelArray[0].min, modelArray[0].max, lightVolArray.data(), lightVolArray.size()))
+            std::cout << "Lightvols do not match the world bounds, ignoring them" << std::endl;
+    }
+
+    if (!cached)
+        preparePatches(pool);
+    endStage("patches");
+    preparePlanes();
+    prepareNodes();
+    endStage("nodes");
+    prepareCulling(pool, !cached);
+    endStage("culling");
+    if (!cached && !cacheDirectory.empty())
+    {
+        saveCache(hash);
+        endStage("save cache");
+    }
+    prepareBrushes();
+    endStage("brushes");
+    return true;
+}
+
+// Faces are tessellated separately, then joined into groups wherever two
+// of them share the controls of an edge
+void Map::preparePatches(ThreadPool* pool)
+{
+    PROFILE_ZONE("Map::preparePatches");
+    std::vector<Vertex> patchVertices;
+    std::vector<unsigned int> patchIndices;
+    std::vector<int> patchFaces(faceArray.size(), -1);
+    std::vector<PatchFace> patches;
+    std::vector<PatchGroup> groups;
+
+    std::vector<int> faces;
+    std::vector<int> vertexOffsets;
+    int vertexCount = 0;
+    int indexCount = 0;
+    for (std::size_t i = 0; i < faceArray.size(); i++)
+    {
+        const Face& face = faceArray[i];
+        if (face.type != Face::Bezier)
+            continue;
+        int dimX = (face.bezierSize[0] - 1) / 2;
+        int dimY = (face.bezierSize[1] - 1) / 2;
+        if (dimX <= 0 || dimY <= 0 || face.vertexOffset < 0)
+            continue;
+        if ((std::size_t)face.vertexOffset + face.bezierSize[0] * face.bezierSize[1] > vertexArray.size())
+            continue;
+
+        PatchFace patch;
+        patch.group = patches.size();
+        for (int level = 0; level < PATCH_LEVELCOUNT; level++)
+        {
+            int size = 2 << level;
+            patch.meshIndexOffset[level] = meshIndexArray.size() + indexCount;
+            patch.meshIndexCount[level] = dimX * dimY * size * size * 6;
+            indexCount += patch.meshIndexCount[level];
         }
-        shaderArray.push_back(shader);
+        patchFaces[i] = patches.size();
+        patches.push_back(patch);
+        faces.push_back(i);
+        vertexOffsets.push_back(vertexCount);
+        vertexCount += (dimX * PATCH_MAXSIZE + 1) * (dimY * PATCH_MAXSIZE + 1);
     }
 
-    int planeCount = header.lumps[PLANE].size / sizeof(Plane);
-    PHYSFS_seek(file, header.lumps[PLANE].offset);
-    planeArray.resize(planeCount);
-    if (planeCount > 0)
-        PHYSFS_read(file, &planeArray[0], sizeof(Plane), planeCount);
+    int patchCount = patches.size();
+    patchVertices.resize(vertexCount);
+    patchIndices.resize(indexCount);
+    std::vector<float> errors(patchCount * PATCH_LEVELCOUNT);
 
-    int nodeCount = header.lumps[NODE].size / sizeof(Node);
-    PHYSFS_seek(file, header.lumps[NODE].offset);
-    nodeArray.resize(nodeCount);
-    if (nodeCount > 0)
-        PHYSFS_read(file, &nodeArray[0], sizeof(Node), nodeCount);
-
-    int leafCount = header.lumps[LEAF].size / sizeof(Leaf);
-    PHYSFS_seek(file, header.lumps[LEAF].offset);
-    leafArray.resize(leafCount);
-    if (leafCount > 0)
-        PHYSFS_read(file, &leafArray[0], sizeof(Leaf), leafCount);
-
-    int leafFaceCount = header.lumps[LEAFFACE].size / sizeof(int);
-    PHYSFS_seek(file, header.lumps[LEAFFACE].offset);
-    leafFaceArray.resize(leafFaceCount);
-    if (leafFaceCount > 0)
-        PHYSFS_read(file, &leafFaceArray[0], sizeof(int), leafFaceCount);
-
-    int leafBrushCount = header.lumps[LEAFBRUSH].size / sizeof(int);
-    PHYSFS_seek(file, header.lumps[LEAFBRUSH].offset);
-    leafBrushArray.resize(leafBrushCount);
-    if (leafBrushCount > 0)
-        PHYSFS_read(file, &leafBrushArray[0], sizeof(int), leafBrushCount);
-
-    int modelCount = header.lumps[MODEL].size / sizeof(Model);
-    PHYSFS_seek(file, header.lumps[MODEL].offset);
-    modelArray.resize(modelCount);
-    if (modelCount > 0)
-        PHYSFS_read(file, &modelArray[0], sizeof(Model), modelCount);
-
-    int brushCount = header.lumps[BRUSH].size / sizeof(Brush);
-    PHYSFS_seek(file, header.lumps[BRUSH].offset);
-    brushArray.resize(brushCount);
-    if (brushCount > 0)
-        PHYSFS_read(file, &brushArray[0], sizeof(Brush), brushCount);
-
-    int brushSideCount = header.lumps[BRUSHSIDE].size / sizeof(BrushSide);
-    PHYSFS_seek(file, header.lumps[BRUSHSIDE].offset);
-    brushSideArray.resize(brushSideCount);
-    if (brushSideCount > 0)
-        PHYSFS_read(file, &brushSideArray[0], sizeof(BrushSide), brushSideCount);
-
-    int effectCount = header.lumps[EFFECT].size / sizeof(Effect);
-    PHYSFS_seek(file, header.lumps[EFFECT].offset);
-    effectArray.resize(effectCount);
-    if (effectCount > 0)
-        PHYSFS_read(file, &effectArray[0], sizeof(Effect), effectCount);
-
-    int lightMapCount = header.lumps[LIGHTMAP].size / (128 * 128 * 3);
-    PHYSFS_seek(file, header.lumps[LIGHTMAP].offset);
-    lightMapArray.resize(lightMapCount + 1);
-    for (int i = 0; i < lightMapCount; i++)
-    {
-        std::array<sf::Uint8, 128 * 128 * 4> rawLightMap;
-        for (int i = 0; i < 128 * 128; i++)
-        {
-            PHYSFS_read(file, &rawLightMap[i * 4], 3, 1);
-            rawLightMap[i * 4 + 3] = 255;
-        }
-        sf::Image image;
-        image.create(128, 128, &rawLightMap[0]);
-        sf::Texture &texture = lightMapArray[i];
-        texture.loadFromImage(image);
-        texture.setRepeated(true);
-        texture.setSmooth(true);
-    }
-    {
-        sf::Image image;
-        image.create(1, 1, sf::Color(85, 85, 85));
-        lightMapArray[lightMapCount].loadFromImage(image);
-    }
-
-    int faceCount = header.lumps[FACE].size / sizeof(RawFace);
-    int bezierCount = 0;
-    int bezierPatchSize = (bezierLevel + 1) * (bezierLevel + 1);
-    int bezierIndexSize = bezierLevel * bezierLevel * 6;
-    PHYSFS_seek(file, header.lumps[FACE].offset);
-    faceArray.resize(faceCount);
-    for (int i = 0; i < faceCount; i++)
-    {
-        RawFace rawFace;
-        PHYSFS_read(file, &rawFace, sizeof(RawFace), 1);
-        Face &face = faceArray[i];
-        face.shader = rawFace.shader;
-        face.effect = rawFace.effect;
-        face.vertexOffset = rawFace.vertexOffset;
-        face.vertexCount = rawFace.vertexCount;
-        face.meshIndexOffset = rawFace.meshVertexOffset;
-        face.meshIndexCount = rawFace.meshVertexCount;
-        face.lightMap = rawFace.lightMap;
-        if (rawFace.lightMap < 0)
-            face.lightMap = lightMapCount;
-        switch (rawFace.type)
-        {
-        case 1:
-            face.type = Face::Brush;
-            break;
-        case 2:
-            face.type = Face::Bezier;
-            break;
-        case 3:
-            face.type = Face::Model;
-            break;
-        default:
-            face.type = Face::None;
-            break;
-        }
-
-        if (face.type == Face::Bezier)
-        {
-            face.bezierSize[0] = rawFace.size[0];
-            face.bezierSize[1] = rawFace.size[1];
-            int dimX = (face.bezierSize[0] - 1) / 2;
-            int dimY = (face.bezierSize[0] - 1) / 2;
-            int size = dimX * dimY;
-            bezierCount += size;
-        }
-    }
-
-    int meshVertexCount = header.lumps[MESHVERTEX].size / sizeof(GLuint);
-    PHYSFS_seek(file, header.lumps[MESHVERTEX].offset);
-    meshIndexArray.resize(meshVertexCount + bezierIndexSize * bezierCount);
-    if (meshVertexCount > 0)
-        PHYSFS_read(file, &meshIndexArray[0], sizeof(GLuint), meshVertexCount);
+    Tesselator tesselator(PATCH_MAXSIZE);
+    TaskGraph graph;
+    graph.addRange(patchCount, 16, [&](int begin, int end)
+    {
+        PROFILE_ZONE("patch levels");
+        for (int i = begin; i < end; i++)
+        {
+            tesselatePatch(tesselator, faces[i], patches[i], &patchVertices[vertexOffsets[i]],
+                           patchIndices.empty() ? NULL : &patchIndices[0], vertexOffsets[i], &errors[i * PATCH_LEVELCOUNT]);
+        }
+    }, std::vector<TaskGraph::Task>());
+    graph.run(pool);
+
+    // Edges are keyed by their three controls rounded to an eighth of a
+    // unit, starting from the lower end so both sides agree
+    typedef std::array<int, 9> EdgeKey;
+    std::vector<std::pair<EdgeKey, int> > edges;
+    for (int i = 0; i < patchCount; i++)
+    {
+        const Face& face = faceArray[faces[i]];
+        int width = face.bezierSize[0];
+        int height = face.bezierSize[1];
+        const Vertex* controls = &vertexArray[face.vertexOffset];
+        auto addEdge = [&](int first, int step)
+        {
+            EdgeKey key;
+            for (int j = 0; j < 3; j++)
+            {
+                const glm::vec3& position = controls[first + j * step].position;
+                for (int k = 0; k < 3; k++)
+                    key[j * 3 + k] = (int)std::floor(position[k] * 8.f + 0.5f);
+            }
+            if (std::lexicographical_compare(key.begin() + 6, key.end(), key.begin(), key.begin() + 3))
+            {
+                for (int k = 0; k < 3; k++)
+                    std::swap(key[k], key[6 + k]);
+            }
+            edges.push_back(std::make_pair(key, i));
+        };
+        for (int x = 0; x + 2 < width; x += 2)
+        {
+            addEdge(x, 1);
+            addEdge(x + (height - 1) * width, 1);
+        }
+        for (int y = 0; y + 2 < height; y += 2)
+        {
+            addEdge(y * width, width);
+            addEdge(y * width + width - 1, width);
+        }
+    }
+    std::sort(edges.begin(), edges.end());
 
-    int vertexCount = header.lumps[VERTEX].size / sizeof(Vertex);
-    PHYSFS_seek(file, header.lumps[VERTEX].offset);
-    vertexArray.resize(vertexCount + bezierCount * bezierPatchSize);
-    if (vertexCount > 0)
-        PHYSFS_read(file, &vertexArray[0], sizeof(Vertex), vertexCount);
+    std::vector<int> parents(patchCount);
+    for (int i = 0; i < patchCount; i++)
+    {
+        parents[i] = i;
+    }
+    auto findRoot = [&](int index)
+    {
+        while (parents[index] != index)
+        {
+            parents[index] = parents[parents[index]];
+            index = parents[index];
+        }
+        return index;
+    };
+    for (std::size_t i = 1; i < edges.size(); i++)
+    {
+        if (edges[i].first != edges[i - 1].first)
+            continue;
+        int a = findRoot(edges[i].second);
+        int b = findRoot(edges[i - 1].second);
+        if (a != b)
+            parents[std::max(a, b)] = std::min(a, b);
+    }
+
+    for (int i = 0; i < patchCount; i++)
+    {
+        PatchFace& patch = patches[i];
+        int root = findRoot(i);
+        if (root == i)
+        {
+            PatchGroup group;
+            group.bounds = patch.bounds;
+            for (int level = 0; level < PATCH_LEVELCOUNT; level++)
+                group.error[level] = 0.f;
+            patch.group = groups.size();
+            groups.push_back(group);
+        }
+        else
+        {
+            patch.group = patches[root].group;
+        }
+
+        PatchGroup& group = groups[patch.group];
+        group.bounds.min = glm::min(group.bounds.min, patch.bounds.min);
+        group.bounds.max = glm::max(group.bounds.max, patch.bounds.max);
+        for (int level = 0; level < PATCH_LEVELCOUNT; level++)
+            group.error[level] = std::max(group.error[level], errors[i * PATCH_LEVELCOUNT + level]);
+    }
+
+    patchVertexArray.take(patchVertices);
+    patchIndexArray.take(patchIndices);
+    facePatches.take(patchFaces);
+    patchArray.take(patches);
+    patchGroupArray.take(groups);
+}
+
+// Fills the vertex grid of one face at the finest level and its indices of
+// every level in the patch index array. The error of a level is measured against the finest grid,
+// the finest level itself is taken to be a quarter of the one before.
+void Map::tesselatePatch(const Tesselator& tesselator, int index, PatchFace& patch, Vertex* grid, unsigned int* patchIndices, int vertexOffset, float* error)
+{
+    const Face& face = faceArray[index];
+
+    int controlWidth = face.bezierSize[0];
+    int dimX = (face.bezierSize[0] - 1) / 2;
+    int dimY = (face.bezierSize[1] - 1) / 2;
+    int gridWidth = dimX * PATCH_MAXSIZE + 1;
+    int gridHeight = dimY * PATCH_MAXSIZE + 1;
 
-    for (int i = 0, vOffset = vertexCount, iOffset = meshVertexCount; i < faceCount; i++)
+    std::vector<PatchJob> jobs;
+    for (int x = 0; x < dimX; x++)
     {
-        Face &face = faceArray[i];
-        if (face.type == Face::Bezier)
+        for (int y = 0; y < dimY; y++)
         {
-            int dimX = (face.bezierSize[0] - 1) / 2;
-            int dimY = (face.bezierSize[1] - 1) / 2;
+            PatchJob job;
+            job.controls = &vertexArray[face.vertexOffset + x * 2 + y * 2 * controlWidth];
+            job.controlWidth = controlWidth;
+            job.out = grid + x * PATCH_MAXSIZE * gridHeight + y * PATCH_MAXSIZE;
+            job.rowStride = gridHeight;
+            jobs.push_back(job);
+        }
+    }
+    tesselator.run(&jobs[0], jobs.size());
 
-            face.meshIndexOffset = iOffset;
+    patch.bounds.min = glm::vec3(1e30f);
+    patch.bounds.max = glm::vec3(-1e30f);
+    for (int i = 0; i < gridWidth * gridHeight; i++)
+    {
+        grid[i].lmCoord = lightMapAtlas.remap(face.lightMap, grid[i].lmCoord);
+        patch.bounds.min = glm::min(patch.bounds.min, grid[i].position);
+        patch.bounds.max = glm::max(patch.bounds.max, grid[i].position);
+    }
 
-            for (int x = 0, n = 0; n < dimX; n++, x = 2 * n)
+    unsigned int base = vertexArray.size() + vertexOffset;
+    for (int level = 0; level < PATCH_LEVELCOUNT; level++)
+    {
+        int step = PATCH_MAXSIZE >> (level + 1);
+        unsigned int* indices = patchIndices + (patch.meshIndexOffset[level] - meshIndexArray.size());
+        error[level] = 0.f;
+        for (int x = 0; x + step < gridWidth; x += step)
+        {
+            for (int y = 0; y + step < gridHeight; y += step)
             {
-                for (int y = 0, m = 0; m < dimY; m++, y = 2 * m)
+                indices[0] = base + (x       ) * gridHeight + (y       );
+                indices[1] = base + (x       ) * gridHeight + (y + step);
+                indices[2] = base + (x + step) * gridHeight + (y + step);
+
+                indices[3] = base + (x + step) * gridHeight + (y + step);
+                indices[4] = base + (x + step) * gridHeight + (y       );
+                indices[5] = base + (x       ) * gridHeight + (y       );
+                indices += 6;
+
+                if (step == 1)
+                    continue;
+                const glm::vec3& corner00 = grid[x * gridHeight + y].position;
+                const glm::vec3& corner01 = grid[x * gridHeight + y + step].position;
+                const glm::vec3& corner10 = grid[(x + step) * gridHeight + y].position;
+                const glm::vec3& corner11 = grid[(x + step) * gridHeight + y + step].position;
+                for (int i = 0; i <= step; i++)
                 {
-                    tesselate(face.vertexOffset + x + face.bezierSize[0] * y, face.bezierSize[0], vOffset, iOffset);
-                    vOffset += bezierPatchSize;
-                    iOffset += bezierIndexSize;
+                    for (int j = 0; j <= step; j++)
+                    {
+                        float s = (float)i / step;
+                        float t = (float)j / step;
+                        glm::vec3 flat = glm::mix(glm::mix(corner00, corner10, s), glm::mix(corner01, corner11, s), t);
+                        error[level] = std::max(error[level], glm::length(flat - grid[(x + i) * gridHeight + y + j].position));
+                    }
                 }
             }
+        }
+        if (step == 1)
+            error[level] = error[level - 1] * 0.25f;
+    }
+}
+
+// Coarsest level whose error stays under the tolerance when seen from the
+// nearest point of the group
+int Map::selectPatchLevel(int group, const RenderPass& pass) const
+{
+    const PatchGroup& patchGroup = patchGroupArray[group];
+    glm::vec3 nearest = glm::min(glm::max(pass.pos, patchGroup.bounds.min), patchGroup.bounds.max);
+    float distance = std::max(glm::length(nearest - pass.pos), 1.f);
+    float allowed = pass.patchTolerance * distance / pass.patchScale;
+
+    int level = 0;
+    while (level < PATCH_LEVELCOUNT - 1 && patchGroup.error[level] > allowed)
+        level++;
+    return level;
+}
+
+// Only planes with the other two components exactly zero count as axial,
+// so the fast path gives the same result as the dot product
+static int planeType(const glm::vec3& normal)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        if (std::fabs(normal[i]) == 1.f && normal[(i + 1) % 3] == 0.f && normal[(i + 2) % 3] == 0.f)
+            return PLANE_X + i;
+    }
+    return PLANE_NONAXIAL;
+}
 
-            face.meshIndexCount = iOffset - face.meshIndexOffset;
+void Map::preparePlanes()
+{
+    PROFILE_ZONE("Map::preparePlanes");
+    typedPlaneArray.resize(planeArray.size());
+    for (std::size_t i = 0; i < planeArray.size(); i++)
+    {
+        const Plane& plane = planeArray[i];
+        TypedPlane& typed = typedPlaneArray[i];
+        typed.normal = plane.normal;
+        typed.distance = plane.distance;
+        typed.type = axialPlanes ? planeType(plane.normal) : PLANE_NONAXIAL;
+        typed.signBits = 0;
+        for (int j = 0; j < 3; j++)
+        {
+            if (plane.normal[j] < 0.f)
+                typed.signBits |= 1 << j;
         }
-        else
+        typed.padding[0] = 0;
+        typed.padding[1] = 0;
+    }
+}
+
+// Works on TypedPlane and FlatNode, axial planes scale by a normal of +-1,
+// which is exact
+template <typename T>
+static inline float planeDot(const T& plane, const glm::vec3& point)
+{
+    if (plane.type < PLANE_NONAXIAL)
+        return point[plane.type] * plane.normal[plane.type];
+    return glm::dot(plane.normal, point);
+}
+
+// Distance of a point in front of a plane
+template <typename T>
+static inline float planeDistance(const T& plane, const glm::vec3& point)
+{
+    return planeDot(plane, point) - plane.distance;
+}
+
+// Breadth first keeps the top of the tree, which every walk goes through,
+// packed together. Nodes the root never reaches go at the end.
+void Map::prepareNodes()
+{
+    PROFILE_ZONE("Map::prepareNodes");
+    int nodeCount = nodeArray.size();
+    std::vector<int> order;
+    std::vector<int> remap(nodeCount, -1);
+    order.reserve(nodeCount);
+    if (nodeCount > 0)
+    {
+        order.push_back(0);
+        remap[0] = 0;
+    }
+    for (std::size_t i = 0; i < order.size(); i++)
+    {
+        const Node& node = nodeArray[order[i]];
+        for (int j = 0; j < 2; j++)
         {
-            for (int i = 0; i < face.meshIndexCount; i++)
+            int child = node.children[j];
+            if (child >= 0 && child < nodeCount && remap[child] < 0)
             {
-                meshIndexArray[face.meshIndexOffset + i] += face.vertexOffset;
+                remap[child] = order.size();
+                order.push_back(child);
             }
         }
     }
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, vertexArray.size() * sizeof(Vertex), &vertexArray[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    for (int i = 0; i < nodeCount; i++)
+    {
+        if (remap[i] < 0)
+        {
+            remap[i] = order.size();
+            order.push_back(i);
+        }
+    }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, meshIndexArray.size() * sizeof(GLuint), &meshIndexArray[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    flatNodeArray.resize(nodeCount);
+    for (int i = 0; i < nodeCount; i++)
+    {
+        const Node& node = nodeArray[order[i]];
+        const TypedPlane& plane = typedPlaneArray[node.plane];
+        FlatNode& flat = flatNodeArray[i];
+        flat.normal = plane.normal;
+        flat.distance = plane.distance;
+        flat.type = plane.type;
+        flat.plane = node.plane;
+        for (int j = 0; j < 2; j++)
+        {
+            int child = node.children[j];
+            flat.children[j] = child >= 0 && child < nodeCount ? remap[child] : child;
+        }
+        flat.bounds.min = glm::vec3(node.min[0], node.min[1], node.min[2]);
+        flat.bounds.max = glm::vec3(node.max[0], node.max[1], node.max[2]);
+        flat.padding[0] = 0;
+        flat.padding[1] = 0;
+    }
+}
 
-    int lightVolCount = header.lumps[LIGHTVOL].size / sizeof(RawLightVol);
-    PHYSFS_seek(file, header.lumps[LIGHTVOL].offset);
-    lightVolArray.reserve(lightVolCount);
-    for (int i = 0; i < lightVolCount; i++)
+// Brushes without an axial side on some axis are left unbounded along it
+void Map::prepareBrushes()
+{
+    PROFILE_ZONE("Map::prepareBrushes");
+    brushBoundsArray.resize(brushArray.size());
+    for (std::size_t i = 0; i < brushArray.size(); i++)
     {
-        RawLightVol rawLightVol;
-        PHYSFS_read(file, &rawLightVol, sizeof(RawLightVol), 1);
-        LightVol lightVol;
+        const Brush& brush = brushArray[i];
+        Bounds& bounds = brushBoundsArray[i];
+        bounds.min = glm::vec3(-1e30f);
+        bounds.max = glm::vec3(1e30f);
+        for (int j = 0; j < brush.sideCount; j++)
+        {
+            const Plane& plane = planeArray[brushSideArray[j + brush.sideOffset].plane];
+            for (int k = 0; k < 3; k++)
+            {
+                if (plane.normal[k] == 1.f)
+                    bounds.max[k] = std::min(bounds.max[k], plane.distance);
+                else if (plane.normal[k] == -1.f)
+                    bounds.min[k] = std::max(bounds.min[k], -plane.distance);
+            }
+        }
+    }
 
-        lightVol.ambient.x = rawLightVol.ambient[0];
-        lightVol.ambient.y = rawLightVol.ambient[1];
-        lightVol.ambient.z = rawLightVol.ambient[2];
-        lightVol.ambient = lightVol.ambient / 256.f;
+    // Padded so four entries can always be loaded at once
+    std::size_t stride = leafBrushArray.size() + 4;
+    leafBrushBounds.assign(stride * 6, 0.f);
+    for (std::size_t i = 0; i < stride; i++)
+    {
+        Bounds bounds;
+        bounds.min = glm::vec3(1e30f);
+        bounds.max = glm::vec3(-1e30f);
+        if (i < leafBrushArray.size())
+        {
+            int brush = leafBrushArray[i];
+            bounds.min = glm::vec3(-1e30f);
+            bounds.max = glm::vec3(1e30f);
+            if (brush >= 0 && (std::size_t)brush < brushBoundsArray.size())
+                bounds = brushBoundsArray[brush];
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            leafBrushBounds[k * stride + i] = bounds.min[k];
+            leafBrushBounds[(k + 3) * stride + i] = bounds.max[k];
+        }
+    }
+}
 
-        lightVol.directional.x = rawLightVol.directional[0];
-        lightVol.directional.y = rawLightVol.directional[1];
-        lightVol.directional.z = rawLightVol.directional[2];
-        lightVol.directional = lightVol.directional / 256.f;
+// Bit k is set when the box overlaps the bounds of leaf brush entry first + k
+static int brushOverlaps(const std::vector<float>& bounds, int first, const glm::vec3& min, const glm::vec3& max)
+{
+    std::size_t stride = bounds.size() / 6;
+    const float* entries = &bounds[first];
+#ifdef BSP_SSE2
+    __m128 overlap = _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(entries), _mm_set1_ps(max.x)), _mm_cmpge_ps(_mm_loadu_ps(entries + 3 * stride), _mm_set1_ps(min.x)));
+    overlap = _mm_and_ps(overlap, _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(entries + stride), _mm_set1_ps(max.y)), _mm_cmpge_ps(_mm_loadu_ps(entries + 4 * stride), _mm_set1_ps(min.y))));
+    overlap = _mm_and_ps(overlap, _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(entries + 2 * stride), _mm_set1_ps(max.z)), _mm_cmpge_ps(_mm_loadu_ps(entries + 5 * stride), _mm_set1_ps(min.z))));
+    return _mm_movemask_ps(overlap);
+#else
+    int mask = 0;
+    for (int k = 0; k < 4; k++)
+    {
+        if (entries[k] <= max.x && entries[3 * stride + k] >= min.x
+            && entries[stride + k] <= max.y && entries[4 * stride + k] >= min.y
+            && entries[2 * stride + k] <= max.z && entries[5 * stride + k] >= min.z)
+            mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
 
-        float phi = (int(rawLightVol.direction[0]) - 128) / 256.f * 180;
-        float thetha = int(rawLightVol.direction[1]) / 256.f * 360;
+// The face bounds are only built when they did not come from the cache
+void Map::prepareCulling(ThreadPool* pool, bool faceBounds)
+{
+    PROFILE_ZONE("Map::prepareCulling");
+    int clusterCount = visData.clusterCount;
+    clusterCache.reset(clusterCount);
+    clusterMarks.assign(faceArray.size(), 0);
+
+    clusterLeafOffsets.assign(clusterCount + 2, 0);
+    clusterLeaves.resize(leafArray.size());
+    for (std::size_t i = 0; i < leafArray.size(); i++)
+    {
+        int cluster = leafArray[i].cluster;
+        if (cluster < 0 || cluster >= clusterCount)
+            cluster = clusterCount;
+        clusterLeafOffsets[cluster + 1]++;
+    }
+    for (int i = 0; i < clusterCount + 1; i++)
+    {
+        clusterLeafOffsets[i + 1] += clusterLeafOffsets[i];
+    }
+    std::vector<int> fill(clusterLeafOffsets.begin(), clusterLeafOffsets.end() - 1);
+    for (std::size_t i = 0; i < leafArray.size(); i++)
+    {
+        int cluster = leafArray[i].cluster;
+        if (cluster < 0 || cluster >= clusterCount)
+            cluster = clusterCount;
+        clusterLeaves[fill[cluster]++] = i;
+    }
 
-        lightVol.direction.x = sin(thetha) * cos(phi);
-        lightVol.direction.y = cos(thetha) * cos(phi);
-        lightVol.direction.z = sin(phi);
-        lightVol.direction = glm::normalize(lightVol.direction);
+    TaskGraph graph;
+    nodeBoundsArray.resize(nodeArray.size());
+    leafBoundsArray.resize(leafArray.size());
+    graph.add([&]()
+    {
+        PROFILE_ZONE("node bounds");
+        for (std::size_t i = 0; i < nodeArray.size(); i++)
+        {
+            const Node& node = nodeArray[i];
+            nodeBoundsArray[i].min = glm::vec3(node.min[0], node.min[1], node.min[2]);
+            nodeBoundsArray[i].max = glm::vec3(node.max[0], node.max[1], node.max[2]);
+        }
+        for (std::size_t i = 0; i < leafArray.size(); i++)
+        {
+            const Leaf& leaf = leafArray[i];
+            leafBoundsArray[i].min = glm::vec3(leaf.min[0], leaf.min[1], leaf.min[2]);
+            leafBoundsArray[i].max = glm::vec3(leaf.max[0], leaf.max[1], leaf.max[2]);
+        }
+    });
 
-        lightVolArray.push_back(lightVol);
+    std::vector<Bounds> faceBoundsList;
+    std::vector<TaskGraph::Task> boundsStage;
+    if (faceBounds)
+    {
+        faceBoundsList.resize(faceArray.size());
+        boundsStage.push_back(graph.addRange(faceArray.size(), 1024, [&](int begin, int end)
+        {
+            PROFILE_ZONE("face bounds");
+            for (int i = begin; i < end; i++)
+            {
+                const Face& face = faceArray[i];
+                Bounds& bounds = faceBoundsList[i];
+                bounds.min = glm::vec3(1e30f);
+                bounds.max = glm::vec3(-1e30f);
+                for (int j = 0; j < face.meshIndexCount; j++)
+                {
+                    unsigned int index = meshIndexArray[face.meshIndexOffset + j];
+                    if (index >= vertexArray.size())
+                        continue;
+                    bounds.min = glm::min(bounds.min, vertexArray[index].position);
+                    bounds.max = glm::max(bounds.max, vertexArray[index].position);
+                }
+                if (facePatches[i] >= 0)
+                {
+                    const Bounds& patchBounds = patchArray[facePatches[i]].bounds;
+                    bounds.min = glm::min(bounds.min, patchBounds.min);
+                    bounds.max = glm::max(bounds.max, patchBounds.max);
+                }
+            }
+        }, std::vector<TaskGraph::Task>()));
+    }
+
+    std::vector<std::vector<int> > lists;
+    if (clusterCacheEager && clusterCache.limit() > 0 && !visData.empty())
+    {
+        lists.resize(clusterCount);
+        graph.addRange(clusterCount, 64, [&](int begin, int end)
+        {
+            PROFILE_ZONE("cluster faces");
+            std::vector<char> marks(faceArray.size(), 0);
+            for (int i = begin; i < end; i++)
+            {
+                buildClusterFaces(i, lists[i], marks);
+            }
+        }, boundsStage);
+    }
+
+    graph.run(pool);
+    if (faceBounds)
+        faceBoundsArray.take(faceBoundsList);
+
+    for (std::size_t i = 0; i < lists.size() && clusterCache.size() < clusterCache.limit(); i++)
+    {
+        clusterCache.insert(i, lists[i]);
     }
+}
 
-    PHYSFS_seek(file, header.lumps[VISDATA].offset);
-    if (header.lumps[VISDATA].size > 0)
+// Opaque faces in every leaf visible from the cluster, without duplicates
+// and sorted by shader then lightmap page so draws can be batched
+void Map::buildClusterFaces(int cluster, std::vector<int>& faces, std::vector<char>& marks)
+{
+    faces.clear();
+    int clusterCount = visData.clusterCount;
+    for (int other = 0; other <= clusterCount; other++)
     {
-        PHYSFS_read(file, &visData.clusterCount, sizeof(int), 1);
-        PHYSFS_read(file, &visData.bytesPerCluster, sizeof(int), 1);
-        unsigned int size = visData.clusterCount * visData.bytesPerCluster;
-        std::vector<char> rawVisData(size);
-        PHYSFS_read(file, &rawVisData[0], size, 1);
+        if (other < clusterCount && !visData.test(other, cluster))
+            continue;
 
-        visData.data.resize(size * 8, false);
-        for (unsigned long int byteIndex = 0; byteIndex < size; byteIndex++)
+        for (int i = clusterLeafOffsets[other]; i < clusterLeafOffsets[other + 1]; i++)
         {
-            unsigned char byte = rawVisData.at(byteIndex);
-            for (unsigned int bit = 0; bit < 8; bit++)
+            const Leaf& leaf = leafArray[clusterLeaves[i]];
+            for (int j = 0; j < leaf.faceCount; j++)
             {
-                if (byte & (1 << bit))
-                    visData.data[byteIndex * 8 + bit] = true;
+                int index = leafFaceArray[j + leaf.faceOffset];
+                if (!marks[index])
+                {
+                    marks[index] = 1;
+                    faces.push_back(index);
+                }
             }
         }
     }
 
-    PHYSFS_close(file);
+    for (std::size_t i = 0; i < faces.size(); i++)
+    {
+        marks[faces[i]] = 0;
+    }
+    faces.erase(std::remove_if(faces.begin(), faces.end(), [this](int index)
+    {
+        const Face& face = faceArray[index];
+        const Shader& shader = shaderArray[face.shader];
+        return shader.transparent || !shader.render || face.meshIndexCount <= 0;
+    }), faces.end());
 
-    lightVolSizeX = int(floor(modelArray[0].max.x / 64) - ceil(modelArray[0].min.x / 64) + 1);
-    lightVolSizeY = int(floor(modelArray[0].max.y / 64) - ceil(modelArray[0].min.y / 64) + 1);
-    lightVolSizeZ = int(floor(modelArray[0].max.z / 128) - ceil(modelArray[0].min.z / 128) + 1);
+    std::sort(faces.begin(), faces.end(), [this](int a, int b)
+    {
+        const Face& faceA = faceArray[a];
+        const Face& faceB = faceArray[b];
+        if (faceA.shader != faceB.shader)
+            return faceA.shader < faceB.shader;
+        int pageA = lightMapAtlas.page(faceA.lightMap);
+        int pageB = lightMapAtlas.page(faceB.lightMap);
+        if (pageA != pageB)
+            return pageA < pageB;
+        return faceA.meshIndexOffset < faceB.meshIndexOffset;
+    });
+}
 
-    glDisable(GL_TEXTURE_2D);
-    return true;
+const std::vector<int>* Map::findClusterFaces(int cluster)
+{
+    const std::vector<int>* faces = clusterCache.find(cluster);
+    if (faces)
+        return faces;
+
+    std::vector<int> built;
+    buildClusterFaces(cluster, built, clusterMarks);
+    return clusterCache.insert(cluster, built);
 }
 
 bool Map::clusterVisible(int test, int cam)
 {
-    if (visData.data.size() == 0 || cam < 0 || test < 0)
+    if (visData.empty() || cam < 0 || test < 0)
         return true;
 
-    return visData.data[test * visData.bytesPerCluster * 8 + cam];
+    return visData.test(test, cam);
 }
 
 int Map::findLeaf(glm::vec3& pos)
 {
     int index = 0;
+    if (flatNodes)
+    {
+        while (index >= 0)
+        {
+            const FlatNode& node = flatNodeArray[index];
+            index = node.children[planeDistance(node, pos) >= 0.f ? 0 : 1];
+        }
+        return ~index;
+    }
+
     while (index >= 0)
     {
-        Node& node = nodeArray[index];
-        Plane& plane = planeArray[node.plane];
+        const Node& node = nodeArray[index];
+        const Plane& plane = planeArray[node.plane];
         if (glm::dot(plane.normal, pos) >= plane.distance)
         {
             index = node.children[0];
@@ -644,143 +1304,272 @@ int Map::findLeaf(glm::vec3& pos)
     return ~index;
 }
 
-LightVol Map::findLightVol(glm::vec3& pos)
+Bounds Map::getWorldBounds() const
+{
+    Bounds bounds;
+    bounds.min = glm::vec3(0.f);
+    bounds.max = glm::vec3(0.f);
+    if (modelArray.size() > 0)
+    {
+        bounds.min = modelArray[0].min;
+        bounds.max = modelArray[0].max;
+    }
+    return bounds;
+}
+
+const std::vector<LoadStage>& Map::getLoadStages() const
+{
+    return loadStages;
+}
+
+const LumpArray<Vertex>& Map::getVertices() const
+{
+    return vertexArray;
+}
+
+const LightMapAtlas& Map::getLightMapAtlas() const
+{
+    return lightMapAtlas;
+}
+
+int Map::findLeafCluster(glm::vec3& pos)
+{
+    if (nodeArray.size() == 0)
+        return -1;
+    return leafArray[findLeaf(pos)].cluster;
+}
+
+LightVol Map::findLightVol(const glm::vec3& pos) const
+{
+    return lightGrid.nearest(pos);
+}
+
+const LightGrid& Map::getLightGrid() const
+{
+    return lightGrid;
+}
+
+const EntityList& Map::getEntities() const
 {
-    if (lightVolArray.size() == 0)
-        return LightVol();
-    int cellX = int(floor(pos.x / 64) - ceil(modelArray[0].min.x / 64));
-    int cellY = int(floor(pos.y / 64) - ceil(modelArray[0].min.y / 64));
-    int cellZ = int(floor(pos.z / 128) - ceil(modelArray[0].min.z / 128));
-    cellX = std::min(std::max(cellX, 0), (int)lightVolSizeX);
-    cellY = std::min(std::max(cellY, 0), (int)lightVolSizeY);
-    cellZ = std::min(std::max(cellZ, 0), (int)lightVolSizeZ);
-    unsigned int index = cellX;
-    index += cellY * lightVolSizeX;
-    index += cellZ * lightVolSizeX * lightVolSizeY;
-    return lightVolArray[index];
+    return entities;
 }
 
-void Map::renderFace(int index, RenderPass& pass, bool solid)
+void Map::cullFace(int index, RenderPass& pass, bool solid)
 {
-    if (pass.renderedFaces[index])
+    if (pass.renderedFaces.contains(index))
         return;
-    Face& face = faceArray[index];
+    const Face& face = faceArray[index];
     if (shaderArray[face.shader].transparent == solid)
         return;
     if (!shaderArray[face.shader].render)
         return;
 
-    glActiveTexture(GL_TEXTURE0);
-    sf::Texture::bind(&shaderArray[face.shader].texture);
-    glActiveTexture(GL_TEXTURE1);
-    sf::Texture::bind(&lightMapArray[face.lightMap]);
-
-    glDrawElements(GL_TRIANGLES, face.meshIndexCount, GL_UNSIGNED_INT, (void*)(long)(face.meshIndexOffset * sizeof(GLuint)));
-
-    pass.renderedFaces[index] = true;
+    pass.visibleFaces.push_back(index);
+    pass.renderedFaces.insert(index);
 }
 
-void Map::renderNode(int index, RenderPass& pass, bool solid)
+void Map::cullNode(int index, RenderPass& pass, bool solid, unsigned int mask)
 {
     if (index < 0)
     {
-        Leaf& leaf = leafArray[~index];
+        const Leaf& leaf = leafArray[~index];
         if (!clusterVisible(leaf.cluster, pass.cluster))
+        {
+            PROFILE_COUNT(COUNTER_LEAVES_PVS, 1);
             return;
-        if (!pass.frutsum.insideAABB(leaf.max, leaf.min))
-            return;
+        }
+        if (mask != 0)
+        {
+            pass.boxTests++;
+            unsigned char first = 0;
+            unsigned char& lastPlane = pass.planeMasks ? pass.lastPlanes[nodeArray.size() + ~index] : first;
+            if (pass.frutsum.classifyAABB(leafBoundsArray[~index], mask, lastPlane, pass.planeTests) == Frutsum::Outside)
+            {
+                PROFILE_COUNT(COUNTER_LEAVES_FRUSTUM, 1);
+                return;
+            }
+        }
 
+        pass.visibleLeaves++;
         for (int i = 0; i < leaf.faceCount; i++)
         {
             int faceIndex = leafFaceArray[i + leaf.faceOffset];
-            renderFace(faceIndex, pass, solid);
+            cullFace(faceIndex, pass, solid);
         }
         return;
     }
 
-    Node& node = nodeArray[index];
-    if (!pass.frutsum.insideAABB(node.max, node.min))
-        return;
+    PROFILE_COUNT(COUNTER_NODES, 1);
+    if (mask != 0)
+    {
+        pass.boxTests++;
+        unsigned char first = 0;
+        unsigned char& lastPlane = pass.planeMasks ? pass.lastPlanes[index] : first;
+        const Bounds& bounds = flatNodes ? flatNodeArray[index].bounds : nodeBoundsArray[index];
+        if (pass.frutsum.classifyAABB(bounds, mask, lastPlane, pass.planeTests) == Frutsum::Outside)
+            return;
+        if (!pass.planeMasks)
+            mask = Frutsum::ALLPLANES;
+    }
 
-    Plane& plane = planeArray[node.plane];
+    bool front;
+    const int* children;
+    if (flatNodes)
+    {
+        const FlatNode& node = flatNodeArray[index];
+        front = planeDistance(node, pass.pos) >= 0.f;
+        children = node.children;
+    }
+    else
+    {
+        const Node& node = nodeArray[index];
+        const Plane& plane = planeArray[node.plane];
+        front = glm::dot(plane.normal, pass.pos) >= plane.distance;
+        children = node.children;
+    }
 
-    if ((glm::dot(plane.normal, pass.pos) >= plane.distance) == solid)
+    if (front == solid)
     {
-        renderNode(node.children[0], pass, solid);
-        renderNode(node.children[1], pass, solid);
+        cullNode(children[0], pass, solid, mask);
+        cullNode(children[1], pass, solid, mask);
     }
     else
     {
-        renderNode(node.children[1], pass, solid);
-        renderNode(node.children[0], pass, solid);
+        cullNode(children[1], pass, solid, mask);
+        cullNode(children[0], pass, solid, mask);
     }
 }
 
-void Map::renderWorld(glm::mat4 matrix, glm::vec3 pos)
+void Map::cullWorld(RenderPass& pass, bool solid)
 {
-    glFrontFace(GL_CW);
-    glEnable(GL_TEXTURE_2D);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LEQUAL);
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
-
+    PROFILE_ZONE("Map::cullWorld");
+    // Room for every face up front so no frame has to grow the list
+    pass.visibleFaces.clear();
+    pass.visibleFaces.reserve(faceArray.size());
     if (nodeArray.size() == 0)
         return;
+    pass.renderedFaces.begin(faceArray.size());
+
+    pass.cluster = findLeafCluster(pass.pos);
+
+    // Blended faces have to come back to front so they still walk the tree.
+    // Faces are tested directly, no leaves are visited here.
+    if (solid && pass.cluster >= 0 && pass.cluster < visData.clusterCount && !visData.empty() && clusterCache.limit() > 0)
+    {
+        const std::vector<int>& faces = *findClusterFaces(pass.cluster);
+        if (faces.empty())
+            return;
+        pass.visibleFaces.resize(faces.size());
+        int count = pass.frutsum.insideAABBs(&faceBoundsArray[0], &faces[0], faces.size(), &pass.visibleFaces[0]);
+        pass.visibleFaces.resize(count);
+        pass.boxTests += faces.size();
+        pass.planeTests += faces.size() * 6;
+        return;
+    }
+
+    if (pass.lastPlanes.size() != nodeArray.size() + leafArray.size())
+        pass.lastPlanes.assign(nodeArray.size() + leafArray.size(), 0);
+    cullNode(0, pass, solid, Frutsum::ALLPLANES);
+}
+
+// Sorting is only safe for opaque faces, blended ones are merged where
+// neighbours in the list happen to share state. Bezier faces are drawn at
+// the level the pass picks for them.
+void Map::batchFaces(RenderPass& pass, bool sort, DrawList& list)
+{
+    PROFILE_ZONE("Map::batchFaces");
+    std::vector<int>& faces = pass.visibleFaces;
+    list.clear();
+    list.batches.reserve(faceArray.size());
+    list.rangeOffsets.reserve(faceArray.size());
+    list.rangeCounts.reserve(faceArray.size());
+    bool patchLevels = pass.patchTolerance > 0.f && pass.patchScale > 0.f;
+    if (sort)
+    {
+        std::sort(faces.begin(), faces.end(), [this](int a, int b)
+        {
+            const Face& faceA = faceArray[a];
+            const Face& faceB = faceArray[b];
+            if (faceA.shader != faceB.shader)
+                return faceA.shader < faceB.shader;
+            int pageA = lightMapAtlas.page(faceA.lightMap);
+            int pageB = lightMapAtlas.page(faceB.lightMap);
+            if (pageA != pageB)
+                return pageA < pageB;
+            return faceA.meshIndexOffset < faceB.meshIndexOffset;
+        });
+    }
+
+    DrawBatch* batch = NULL;
+    for (std::size_t i = 0; i < faces.size(); i++)
+    {
+        const Face& face = faceArray[faces[i]];
+        if (face.meshIndexCount <= 0)
+            continue;
+        list.faces++;
+
+        int meshIndexOffset = face.meshIndexOffset;
+        int meshIndexCount = face.meshIndexCount;
+        if (patchLevels && facePatches[faces[i]] >= 0)
+        {
+            const PatchFace& patch = patchArray[facePatches[faces[i]]];
+            int level = selectPatchLevel(patch.group, pass);
+            meshIndexOffset = patch.meshIndexOffset[level];
+            meshIndexCount = patch.meshIndexCount[level];
+        }
+        list.triangles += meshIndexCount / 3;
 
-    glUseProgram(program);
-    glEnableVertexAttribArray(0);
-    //glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
-    glEnableVertexAttribArray(3);
-    glUniformMatrix4fv(programLoc["matrix"], 1, GL_FALSE, &matrix[0][0]);
-    glUniform1i(programLoc["texture"], 0);
-    glUniform1i(programLoc["lightmap"], 1);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), VertexPosition);
-    //glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE,  sizeof(Vertex), VertexNormal);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), VertexTexCoord);
-    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), VertexLMCoord);
-
-    RenderPass pass(this, pos, matrix);
-    pass.cluster = leafArray[findLeaf(pos)].cluster;
-
-    glEnable(GL_CULL_FACE);
-    glDisable(GL_BLEND);
-    renderNode(0, pass, true);
-
-    glDisable(GL_CULL_FACE);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    renderNode(0, pass, false);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glDisable(GL_TEXTURE_2D);
-    glDisable(GL_DEPTH_TEST);
-    glDisable(GL_BLEND);
+        int page = lightMapAtlas.page(face.lightMap);
+        if (!batch || batch->shader != face.shader || batch->lightMapPage != page)
+        {
+            if (!batch || batch->shader != face.shader)
+                list.stateChanges++;
+            if (!batch || batch->lightMapPage != page)
+                list.stateChanges++;
+
+            DrawBatch next;
+            next.shader = face.shader;
+            next.lightMapPage = page;
+            next.rangeOffset = list.rangeOffsets.size();
+            next.rangeCount = 0;
+            list.batches.push_back(next);
+            batch = &list.batches.back();
+        }
+
+        if (batch->rangeCount > 0 && list.rangeOffsets.back() + list.rangeCounts.back() == meshIndexOffset)
+        {
+            list.rangeCounts.back() += meshIndexCount;
+            continue;
+        }
+        list.rangeOffsets.push_back(meshIndexOffset);
+        list.rangeCounts.push_back(meshIndexCount);
+        batch->rangeCount++;
+    }
 }
 
 void Map::traceBrush(int index, TracePass& pass)
 {
-    if (pass.tracedBrushes[index])
+    if (!pass.tracedBrushes.insert(index))
         return;
-    pass.tracedBrushes[index] = true;
-    Brush& brush = brushArray[index];
+    const Brush& brush = brushArray[index];
     if (!shaderArray[brush.shader].solid)
         return;
 
-    Plane* collidingPlane = NULL;
+    const TypedPlane* collidingPlane = NULL;
     float collidingDist = 0.0;
+    pass.brushTests++;
+    PROFILE_COUNT(COUNTER_BRUSHES, 1);
 
     for (int i = 0; i < brush.sideCount; i++)
     {
-        BrushSide& side = brushSideArray[i + brush.sideOffset];
-        Plane& plane = planeArray[side.plane];
+        const BrushSide& side = brushSideArray[i + brush.sideOffset];
+        const TypedPlane& plane = typedPlaneArray[side.plane];
+        pass.sideTests++;
 
-        if (glm::dot(plane.normal, pass.oldPosition) - plane.distance < pass.radius)
+        if (planeDistance(plane, pass.oldPosition) < pass.radius)
             continue;
 
-        float dist = glm::dot(plane.normal, pass.position) - plane.distance - pass.radius;
+        float dist = planeDistance(plane, pass.position) - pass.radius;
 
         if (dist > 0.f)
             return;
@@ -804,33 +1593,330 @@ void Map::traceNode(int index, TracePass& pass)
 {
     if (index < 0)
     {
-        Leaf& leaf = leafArray[~index];
-        for (int i = 0; i < leaf.brushCount; i++)
+        // The box covers both ends of the move, a brush outside of it is in
+        // front of one of its axial sides from both, and is never touched.
+        // A push along a sloped plane can leave the box, so the brushes
+        // still to come are tested again against the moved one.
+        const Leaf& leaf = leafArray[~index];
+        for (int i = 0; i < leaf.brushCount; i += 4)
         {
-            traceBrush(leafBrushArray[i + leaf.brushOffset], pass);
+            int first = leaf.brushOffset + i;
+            int entries = (1 << std::min(leaf.brushCount - i, 4)) - 1;
+            glm::vec3 reach(pass.radius);
+            int mask = entries;
+            if (pass.brushBounds)
+                mask &= brushOverlaps(leafBrushBounds, first, glm::min(pass.position, pass.oldPosition) - reach, glm::max(pass.position, pass.oldPosition) + reach);
+
+            for (int k = 0; k < 4; k++)
+            {
+                if (!(mask & (1 << k)))
+                    continue;
+                glm::vec3 position = pass.position;
+                traceBrush(leafBrushArray[first + k], pass);
+                if (pass.brushBounds && pass.position != position)
+                    mask = (entries & ~((2 << k) - 1)) & brushOverlaps(leafBrushBounds, first, glm::min(pass.position, pass.oldPosition) - reach, glm::max(pass.position, pass.oldPosition) + reach);
+            }
         }
         return;
     }
 
-    Node& node = nodeArray[index];
-    Plane& plane = planeArray[node.plane];
-    float dist = glm::dot(plane.normal, pass.position) - plane.distance;
+    float dist;
+    const int* children;
+    if (flatNodes)
+    {
+        const FlatNode& node = flatNodeArray[index];
+        dist = planeDistance(node, pass.position);
+        children = node.children;
+    }
+    else
+    {
+        const Node& node = nodeArray[index];
+        const Plane& plane = planeArray[node.plane];
+        dist = glm::dot(plane.normal, pass.position) - plane.distance;
+        children = node.children;
+    }
 
     if (dist > -pass.radius)
     {
-        traceNode(node.children[0], pass);
+        traceNode(children[0], pass);
     }
 
     if (dist < pass.radius)
     {
-        traceNode(node.children[1], pass);
+        traceNode(children[1], pass);
     }
 }
 
 glm::vec3 Map::traceWorld(glm::vec3 pos, glm::vec3 oldPos, float radius)
 {
-    TracePass pass(this, pos, oldPos, radius);
-    traceNode(0, pass);
+    return traceWorld(tracePass, pos, oldPos, radius);
+}
+
+// Traces from several threads need a pass each
+glm::vec3 Map::traceWorld(TracePass& pass, glm::vec3 pos, glm::vec3 oldPos, float radius)
+{
+    PROFILE_COUNT(COUNTER_TRACES, 1);
+    pass.reset(pos, oldPos, radius);
+    pass.tracedBrushes.begin(brushArray.size());
+    if (nodeArray.size() > 0)
+        traceNode(0, pass);
 
     return pass.position;
 }
+
+// Moves many spheres at once. The map is only read while tracing, so chunks
+// of the batch can go to the pool, each with a pass of its own that is kept
+// for the next batch. Once the passes exist a batch does not allocate.
+void Map::traceWorld(const glm::vec3* positions, const glm::vec3* oldPositions, const float* radii, glm::vec3* out, int count, ThreadPool* pool)
+{
+    const int grain = 64;
+    std::size_t chunks = (count + grain - 1) / grain;
+    if (batchTracePasses.size() < chunks)
+        batchTracePasses.resize(chunks);
+
+    batchTraceRange.run(pool, count, grain, [&](int begin, int end)
+    {
+        PROFILE_ZONE("traces");
+        TracePass& pass = batchTracePasses[begin / grain];
+        for (int i = begin; i < end; i++)
+        {
+            out[i] = traceWorld(pass, positions[i], oldPositions[i], radii[i]);
+        }
+    });
+}
+
+// Sweeps stop this far in front of the planes they hit so the next move
+// does not start inside the brush
+const float SWEEP_EPSILON = 0.125f;
+
+// How far a plane has to be pushed out for the box or sphere to touch it
+static float sweepOffset(const glm::vec3& normal, const glm::vec3& extents, float radius)
+{
+    return std::fabs(normal.x) * extents.x + std::fabs(normal.y) * extents.y + std::fabs(normal.z) * extents.z + radius;
+}
+
+template <typename T>
+static inline float sweepOffset(const T& plane, const glm::vec3& extents, float radius)
+{
+    if (plane.type < PLANE_NONAXIAL)
+        return extents[plane.type] + radius;
+    return sweepOffset(plane.normal, extents, radius);
+}
+
+// Clips the move against every side of the brush, the move enters the
+// brush at the latest entering side and leaves at the earliest leaving one
+void Map::sweepBrush(int index, SweepPass& pass)
+{
+    if (!pass.tracedBrushes.insert(index))
+        return;
+    const Brush& brush = brushArray[index];
+    if (brush.sideCount <= 0 || !(shaderArray[brush.shader].contents & pass.contentMask))
+        return;
+
+    float enterFraction = -1.f;
+    float leaveFraction = 1.f;
+    const TypedPlane* clipPlane = NULL;
+    const BrushSide* leadSide = NULL;
+    bool startOut = false;
+    bool getOut = false;
+    pass.brushTests++;
+    PROFILE_COUNT(COUNTER_BRUSHES, 1);
+
+    for (int i = 0; i < brush.sideCount; i++)
+    {
+        const BrushSide& side = brushSideArray[i + brush.sideOffset];
+        const TypedPlane& plane = typedPlaneArray[side.plane];
+        pass.sideTests++;
+        float distance = plane.distance + sweepOffset(plane, pass.extents, pass.radius);
+
+        float startDistance = planeDot(plane, pass.start) - distance;
+        float endDistance = planeDot(plane, pass.end) - distance;
+
+        if (endDistance > 0.f)
+            getOut = true;
+        if (startDistance > 0.f)
+            startOut = true;
+
+        // Entirely in front of this side
+        if (startDistance > 0.f && (endDistance >= SWEEP_EPSILON || endDistance >= startDistance))
+            return;
+        if (startDistance <= 0.f && endDistance <= 0.f)
+            continue;
+
+        if (startDistance > endDistance)
+        {
+            float fraction = std::max((startDistance - SWEEP_EPSILON) / (startDistance - endDistance), 0.f);
+            if (fraction > enterFraction)
+            {
+                enterFraction = fraction;
+                clipPlane = &plane;
+                leadSide = &side;
+            }
+        }
+        else
+        {
+            float fraction = std::min((startDistance + SWEEP_EPSILON) / (startDistance - endDistance), 1.f);
+            leaveFraction = std::min(leaveFraction, fraction);
+        }
+    }
+
+    TraceResult& result = pass.result;
+    if (!startOut)
+    {
+        result.startSolid = true;
+        if (!getOut)
+        {
+            result.allSolid = true;
+            result.fraction = 0.f;
+            result.brush = index;
+            result.contents = shaderArray[brush.shader].contents;
+        }
+        return;
+    }
+
+    if (clipPlane && enterFraction < leaveFraction && enterFraction < result.fraction)
+    {
+        result.fraction = std::max(enterFraction, 0.f);
+        result.plane.normal = clipPlane->normal;
+        result.plane.distance = clipPlane->distance;
+        result.brush = index;
+        result.contents = shaderArray[brush.shader].contents;
+        result.surface = shaderArray[leadSide->shader].surface;
+    }
+}
+
+// Walks the part of the move between startFraction and endFraction down
+// the tree, going into both children where the swept volume spans a plane
+void Map::sweepNode(int index, float startFraction, float endFraction, glm::vec3 start, glm::vec3 end, SweepPass& pass)
+{
+    if (pass.result.fraction <= startFraction)
+        return;
+
+    if (index < 0)
+    {
+        // Bounds are grown by the epsilon as well, sides closer than that
+        // can still clip the move
+        const Leaf& leaf = leafArray[~index];
+        glm::vec3 reach = pass.extents + pass.radius + SWEEP_EPSILON;
+        glm::vec3 min = glm::min(pass.start, pass.end) - reach;
+        glm::vec3 max = glm::max(pass.start, pass.end) + reach;
+        for (int i = 0; i < leaf.brushCount; i += 4)
+        {
+            int first = leaf.brushOffset + i;
+            int mask = (1 << std::min(leaf.brushCount - i, 4)) - 1;
+            if (pass.brushBounds)
+                mask &= brushOverlaps(leafBrushBounds, first, min, max);
+
+            for (int k = 0; k < 4; k++)
+            {
+                if (!(mask & (1 << k)))
+                    continue;
+                sweepBrush(leafBrushArray[first + k], pass);
+                if (pass.result.allSolid)
+                    return;
+            }
+        }
+        return;
+    }
+
+    float offset;
+    float startDistance;
+    float endDistance;
+    const int* children;
+    if (flatNodes)
+    {
+        const FlatNode& node = flatNodeArray[index];
+        offset = sweepOffset(node, pass.extents, pass.radius);
+        startDistance = planeDistance(node, start);
+        endDistance = planeDistance(node, end);
+        children = node.children;
+    }
+    else
+    {
+        const Node& node = nodeArray[index];
+        const Plane& plane = planeArray[node.plane];
+        offset = sweepOffset(plane.normal, pass.extents, pass.radius);
+        startDistance = glm::dot(plane.normal, start) - plane.distance;
+        endDistance = glm::dot(plane.normal, end) - plane.distance;
+        children = node.children;
+    }
+
+    if (startDistance >= offset + 1.f && endDistance >= offset + 1.f)
+    {
+        sweepNode(children[0], startFraction, endFraction, start, end, pass);
+        return;
+    }
+    if (startDistance < -offset - 1.f && endDistance < -offset - 1.f)
+    {
+        sweepNode(children[1], startFraction, endFraction, start, end, pass);
+        return;
+    }
+
+    // Split the move where the volume leaves the near side and where it
+    // enters the far side, the two pieces overlap around the plane
+    int side = 0;
+    float nearFraction = 1.f;
+    float farFraction = 0.f;
+    if (startDistance < endDistance)
+    {
+        float inverse = 1.f / (startDistance - endDistance);
+        side = 1;
+        farFraction = (startDistance + offset + SWEEP_EPSILON) * inverse;
+        nearFraction = (startDistance - offset + SWEEP_EPSILON) * inverse;
+    }
+    else if (startDistance > endDistance)
+    {
+        float inverse = 1.f / (startDistance - endDistance);
+        farFraction = (startDistance - offset - SWEEP_EPSILON) * inverse;
+        nearFraction = (startDistance + offset + SWEEP_EPSILON) * inverse;
+    }
+    nearFraction = std::min(std::max(nearFraction, 0.f), 1.f);
+    farFraction = std::min(std::max(farFraction, 0.f), 1.f);
+
+    float middleFraction = startFraction + (endFraction - startFraction) * nearFraction;
+    glm::vec3 middle = start + (end - start) * nearFraction;
+    sweepNode(children[side], startFraction, middleFraction, start, middle, pass);
+
+    middleFraction = startFraction + (endFraction - startFraction) * farFraction;
+    middle = start + (end - start) * farFraction;
+    sweepNode(children[side ^ 1], middleFraction, endFraction, middle, end, pass);
+}
+
+// Boxes are moved so they are centred on the traced points, which lets
+// every plane be pushed out by the same half size
+TraceResult Map::sweepWorld(SweepPass& pass, glm::vec3 start, glm::vec3 end, glm::vec3 mins, glm::vec3 maxs, float radius, int contentMask)
+{
+    PROFILE_COUNT(COUNTER_TRACES, 1);
+    glm::vec3 centre = (mins + maxs) * 0.5f;
+    pass.reset(start + centre, end + centre, (maxs - mins) * 0.5f, radius, contentMask);
+    pass.tracedBrushes.begin(brushArray.size());
+    if (nodeArray.size() > 0)
+        sweepNode(0, 0.f, 1.f, pass.start, pass.end, pass);
+
+    TraceResult& result = pass.result;
+    if (result.allSolid)
+        result.end = start;
+    else
+        result.end = start + (end - start) * result.fraction;
+    return result;
+}
+
+TraceResult Map::traceSphere(glm::vec3 start, glm::vec3 end, float radius, int contentMask)
+{
+    return sweepWorld(sweepPass, start, end, glm::vec3(0.f), glm::vec3(0.f), radius, contentMask);
+}
+
+TraceResult Map::traceSphere(SweepPass& pass, glm::vec3 start, glm::vec3 end, float radius, int contentMask)
+{
+    return sweepWorld(pass, start, end, glm::vec3(0.f), glm::vec3(0.f), radius, contentMask);
+}
+
+TraceResult Map::traceBox(glm::vec3 start, glm::vec3 end, glm::vec3 mins, glm::vec3 maxs, int contentMask)
+{
+    return sweepWorld(sweepPass, start, end, mins, maxs, 0.f, contentMask);
+}
+
+TraceResult Map::traceBox(SweepPass& pass, glm::vec3 start, glm::vec3 end, glm::vec3 mins, glm::vec3 maxs, int contentMask)
+{
+    return sweepWorld(pass, start, end, mins, maxs, 0.f, contentMask);
+}
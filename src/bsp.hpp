@@ -1,15 +1,72 @@
 #ifndef BSP_HPP
 #define BSP_HPP
 
+#include <cstdint>
 #include <string>
 #include <vector>
-#include <map>
 #include <glm/glm.hpp>
-#include <GL/glew.h>
-#include <SFML/Graphics/Texture.hpp>
+#include "clustercache.hpp"
+#include "entities.hpp"
 #include "frutsum.hpp"
+#include "lightgrid.hpp"
+#include "lightmapatlas.hpp"
+#include "lumparray.hpp"
+#include "mappedfile.hpp"
+#include "stampset.hpp"
+#include "taskgraph.hpp"
+#include "visdata.hpp"
 
 class Map;
+class Tesselator;
+
+const int CONTENTS_SOLID        = 0x1;
+const int CONTENTS_LAVA         = 0x8;
+const int CONTENTS_SLIME        = 0x10;
+const int CONTENTS_WATER        = 0x20;
+const int CONTENTS_FOG          = 0x40;
+const int CONTENTS_NOTTEAM1     = 0x80;
+const int CONTENTS_NOTTEAM2     = 0x100;
+const int CONTENTS_NOBOTCLIP    = 0x200;
+const int CONTENTS_AREAPORTAL   = 0x8000;
+const int CONTENTS_PLAYERCLIP   = 0x10000;
+const int CONTENTS_MONSTERCLIP  = 0x20000;
+const int CONTENTS_TELEPORTER   = 0x40000;
+const int CONTENTS_JUMPPAD      = 0x80000;
+const int CONTENTS_CLUSTERPORTAL= 0x100000;
+const int CONTENTS_DONOTENTER   = 0x200000;
+const int CONTENTS_BOTCLIP      = 0x400000;
+const int CONTENTS_MOVER        = 0x800000;
+const int CONTENTS_ORIGIN       = 0x1000000;
+const int CONTENTS_BODY         = 0x2000000;
+const int CONTENTS_CORPSE       = 0x4000000;
+const int CONTENTS_DETAIL       = 0x8000000;
+const int CONTENTS_STRUCTURAL   = 0x10000000;
+const int CONTENTS_TRANSLUCENT  = 0x20000000;
+const int CONTENTS_TRIGGER      = 0x40000000;
+const int CONTENTS_NODROP       = 0x80000000;
+
+const int MASK_PLAYERSOLID = CONTENTS_SOLID | CONTENTS_PLAYERCLIP | CONTENTS_BODY;
+
+const int SURF_NODAMAGE     = 0x1;
+const int SURF_SLICK        = 0x2;
+const int SURF_SKY          = 0x4;
+const int SURF_LADDER       = 0x8;
+const int SURF_NOIMPACT     = 0x10;
+const int SURF_NOMARKS      = 0x20;
+const int SURF_FLESH        = 0x40;
+const int SURF_NODRAW       = 0x80;
+const int SURF_HINT         = 0x100;
+const int SURF_SKIP         = 0x200;
+const int SURF_NOLIGHTMAP   = 0x400;
+const int SURF_POINTLIGHT   = 0x800;
+const int SURF_METALSTEPS   = 0x1000;
+const int SURF_NOSTEPS      = 0x2000;
+const int SURF_NONSOLID     = 0x4000;
+const int SURF_LIGHTFILTER  = 0x8000;
+const int SURF_ALPHASHADOW  = 0x10000;
+const int SURF_NODLIGHT     = 0x20000;
+const int SURF_SURFDUST     = 0x40000;
+
 
 struct Plane {
     glm::vec3 normal;
@@ -23,6 +80,37 @@ struct Node {
     int max[3];
 };
 
+enum
+{
+    PLANE_X = 0,
+    PLANE_Y,
+    PLANE_Z,
+    PLANE_NONAXIAL
+};
+
+// Planes classified at load like Q3's cplane_t. type is the axis of planes
+// facing along +-x, +-y or +-z, signBits has bit i set for a negative
+// normal[i].
+struct TypedPlane {
+    glm::vec3 normal;
+    float distance;
+    unsigned char type;
+    unsigned char signBits;
+    unsigned char padding[2];
+};
+
+// Nodes for traversal in breadth first order with their planes inlined,
+// 64 bytes each. type is the same as the plane's TypedPlane type.
+struct FlatNode {
+    glm::vec3 normal;
+    float distance;
+    int children[2];
+    int type;
+    int plane;
+    Bounds bounds;
+    int padding[2];
+};
+
 struct Leaf {
     int cluster;
     int area;
@@ -94,28 +182,99 @@ struct LightVol {
     glm::vec3 direction;
 };
 
-struct VisData {
-    int clusterCount;
-    int bytesPerCluster;
-    std::vector<bool> data;
+// Lightvol cells as they are in the file. direction holds the longitude
+// and latitude of the light in 256ths of a turn.
+struct PackedLightVol {
+    unsigned char ambient[3];
+    unsigned char directional[3];
+    unsigned char direction[2];
+};
+
+struct LightMap {
+    unsigned char data[128 * 128 * 4];
+};
+
+// Bezier faces are also tessellated at PATCH_LEVELCOUNT levels, level l
+// splitting each 3x3 patch into 2 << l quads a side. All levels index into
+// one grid of vertices at the finest level.
+const int PATCH_LEVELCOUNT = 4;
+const int PATCH_MAXSIZE = 2 << (PATCH_LEVELCOUNT - 1);
+
+struct PatchFace {
+    int group;
+    Bounds bounds;
+    int meshIndexOffset[PATCH_LEVELCOUNT];
+    int meshIndexCount[PATCH_LEVELCOUNT];
+};
+
+// Faces sharing an edge always draw at the same level so no cracks open
+// between them. error is how far each level strays from the curves.
+struct PatchGroup {
+    Bounds bounds;
+    float error[PATCH_LEVELCOUNT];
 };
 
 struct Shader {
     bool transparent;
     bool render;
     bool solid;
+    int surface;
+    int contents;
     std::string name;
-    sf::Texture texture;
 };
 
+// Passes keep their buffers between uses, reset them for each frame or
+// trace rather than constructing new ones
 struct RenderPass {
     glm::vec3 pos;
     Frutsum frutsum;
 
     int cluster;
-    std::vector<bool> renderedFaces;
+    StampSet renderedFaces;
+    std::vector<int> visibleFaces;
+
+    // Plane masks let subtrees fully inside a plane skip it, the plane a
+    // node or leaf last failed on is kept so the next frame tries it first
+    bool planeMasks;
+    std::vector<unsigned char> lastPlanes;
+
+    // Bezier faces pick the coarsest level whose error projects to less
+    // than patchTolerance, in the same units as clip space y. Zero draws
+    // them at the level they were loaded with.
+    float patchTolerance;
+    float patchScale;
+
+    // Counted since the last reset
+    unsigned int boxTests;
+    unsigned int planeTests;
+    unsigned int visibleLeaves;
+
+    RenderPass();
+    RenderPass(const glm::vec3 &position, const glm::mat4 &matrix);
+    void reset(const glm::vec3 &position, const glm::mat4 &matrix);
+};
+
+// Faces grouped into runs sharing a shader and lightmap page. Each batch covers
+// rangeCount entries of the range arrays, ranges being contiguous spans of
+// the mesh index array.
+struct DrawBatch {
+    int shader;
+    int lightMapPage;
+    int rangeOffset;
+    int rangeCount;
+};
+
+struct DrawList {
+    std::vector<DrawBatch> batches;
+    std::vector<int> rangeOffsets;
+    std::vector<int> rangeCounts;
+
+    unsigned int faces;
+    unsigned int triangles;
+    unsigned int stateChanges;
 
-    RenderPass(Map* parent, const glm::vec3 &position, const glm::mat4 &matrix);
+    DrawList();
+    void clear();
 };
 
 struct TracePass {
@@ -123,68 +282,186 @@ struct TracePass {
     glm::vec3 oldPosition;
     float radius;
 
-    std::vector<bool> tracedBrushes;
+    StampSet tracedBrushes;
 
-    TracePass(Map* parent, const glm::vec3 &pos, const glm::vec3 &oldPos, float rad);
+    // Brushes whose bounds miss the move are skipped before their sides
+    // are looked at
+    bool brushBounds;
+
+    // Counted since the last reset
+    unsigned int brushTests;
+    unsigned int sideTests;
+
+    TracePass();
+    void reset(const glm::vec3 &pos, const glm::vec3 &oldPos, float rad);
+};
+
+// Result of a swept trace. fraction is how much of the move was made before
+// touching a brush, brush is -1 if nothing was hit.
+struct TraceResult {
+    float fraction;
+    glm::vec3 end;
+    Plane plane;
+    int brush;
+    int contents;
+    int surface;
+    bool startSolid;
+    bool allSolid;
+};
+
+// Box and sphere sweeps. Boxes are centred on the move so only their half
+// size is kept, spheres have zero extents.
+struct SweepPass {
+    glm::vec3 start;
+    glm::vec3 end;
+    glm::vec3 extents;
+    float radius;
+    int contentMask;
+    TraceResult result;
+
+    StampSet tracedBrushes;
+    bool brushBounds;
+    unsigned int brushTests;
+    unsigned int sideTests;
+
+    SweepPass();
+    void reset(const glm::vec3 &from, const glm::vec3 &to, const glm::vec3 &halfSize, float rad, int mask);
+};
+
+// Wall time of one step of Map::load, the decode step runs its tasks on
+// the pool
+struct LoadStage {
+    const char* name;
+    double milliseconds;
 };
 
 class Map
 {
 protected:
-    GLuint program;
-    GLuint vertexBuffer;
-    GLuint meshIndexBuffer;
-    std::map<std::string, GLuint> programLoc;
+    MappedFile file;
+    MappedFile cacheFile;
+    std::string cacheDirectory;
     VisData visData;
     int bezierLevel;
-
-    std::vector<Plane> planeArray;
-    std::vector<Node> nodeArray;
-    std::vector<Leaf> leafArray;
-    std::vector<int> leafFaceArray;
-    std::vector<int> leafBrushArray;
-    std::vector<Model> modelArray;
-    std::vector<Brush> brushArray;
-    std::vector<BrushSide> brushSideArray;
-    std::vector<Vertex> vertexArray;
-    std::vector<GLuint> meshIndexArray;
-    std::vector<Effect> effectArray;
-    std::vector<Face> faceArray;
-    std::vector<sf::Texture> lightMapArray;
-    std::vector<LightVol> lightVolArray;
+    int lightMapAtlasSize;
+    LightMapAtlas lightMapAtlas;
+
+    LumpArray<Plane> planeArray;
+    LumpArray<Node> nodeArray;
+    LumpArray<Leaf> leafArray;
+    LumpArray<int> leafFaceArray;
+    LumpArray<int> leafBrushArray;
+    LumpArray<Model> modelArray;
+    LumpArray<Brush> brushArray;
+    LumpArray<BrushSide> brushSideArray;
+    LumpArray<Vertex> vertexArray;
+    LumpArray<unsigned int> meshIndexArray;
+    LumpArray<Effect> effectArray;
+    LumpArray<Face> faceArray;
+    LumpArray<LightMap> lightMapArray;
+    LumpArray<PackedLightVol> lightVolArray;
     std::vector<Shader> shaderArray;
 
-    unsigned int lightVolSizeX;
-    unsigned int lightVolSizeY;
-    unsigned int lightVolSizeZ;
-
-    void tesselate(int controlOffset, int controlWidth, int vOffset, int iOffset);
-
-    bool clusterVisible(int test, int cam);
-    int findLeaf(glm::vec3 &pos);
-    int findLeafCluster(glm::vec3 &pos);
-    LightVol findLightVol(glm::vec3 &pos);
-
-    void drawMesh(int faceIndex);
-    void drawPatch(int faceIndex);
-
-    void renderFace(int index, RenderPass &pass, bool solid);
-    void renderNode(int index, RenderPass &pass, bool solid);
+    LightGrid lightGrid;
+    EntityList entities;
+
+    bool axialPlanes;
+    std::vector<TypedPlane> typedPlaneArray;
+    void preparePlanes();
+
+    bool flatNodes;
+    std::vector<FlatNode> flatNodeArray;
+    void prepareNodes();
+
+    // Float copies of the node and leaf bounds for culling
+    std::vector<Bounds> nodeBoundsArray;
+    std::vector<Bounds> leafBoundsArray;
+    LumpArray<Bounds> faceBoundsArray;
+
+    // Leaves grouped by cluster, the last group holds leaves outside of any
+    // cluster which are always visible
+    std::vector<int> clusterLeafOffsets;
+    std::vector<int> clusterLeaves;
+    ClusterCache clusterCache;
+    bool clusterCacheEager;
+    std::vector<char> clusterMarks;
+
+    std::vector<LoadStage> loadStages;
+
+    // Every level of the bezier faces. They go after the vertex and mesh
+    // index arrays in the same buffers, so the indices already include
+    // that offset. Cached along with the face bounds.
+    LumpArray<Vertex> patchVertexArray;
+    LumpArray<unsigned int> patchIndexArray;
+    LumpArray<int> facePatches;
+    LumpArray<PatchFace> patchArray;
+    LumpArray<PatchGroup> patchGroupArray;
+
+    // Brush bounds from their axial sides, and the same bounds for every
+    // leaf brush entry stored as six arrays of minimum and maximum x, y, z
+    std::vector<Bounds> brushBoundsArray;
+    std::vector<float> leafBrushBounds;
+    void prepareBrushes();
+
+    TracePass tracePass;
+    std::vector<TracePass> batchTracePasses;
+    ParallelRange batchTraceRange;
+
+    bool loadCache(std::uint64_t hash, int faceCount, int lightMapCount);
+    void saveCache(std::uint64_t hash);
+    std::string cachePath(std::uint64_t hash);
+
+    void preparePatches(ThreadPool* pool);
+    void tesselatePatch(const Tesselator& tesselator, int index, PatchFace& patch, Vertex* grid, unsigned int* patchIndices, int vertexOffset, float* error);
+    int selectPatchLevel(int group, const RenderPass &pass) const;
+
+    void prepareCulling(ThreadPool* pool, bool faceBounds);
+    void buildClusterFaces(int cluster, std::vector<int>& faces, std::vector<char>& marks);
+    const std::vector<int>* findClusterFaces(int cluster);
+
+    void cullFace(int index, RenderPass &pass, bool solid);
+    void cullNode(int index, RenderPass &pass, bool solid, unsigned int mask);
 
     void traceBrush(int index, TracePass &pass);
     void traceNode(int index, TracePass &pass);
 
+    SweepPass sweepPass;
+    void sweepBrush(int index, SweepPass &pass);
+    void sweepNode(int index, float startFraction, float endFraction, glm::vec3 start, glm::vec3 end, SweepPass &pass);
+    TraceResult sweepWorld(SweepPass &pass, glm::vec3 start, glm::vec3 end, glm::vec3 mins, glm::vec3 maxs, float radius, int contentMask);
+
 public:
     Map();
 
-    bool load(std::string fileName);
-    void renderWorld(glm::mat4 matrix, glm::vec3 pos);
-    glm::vec3 traceWorld(glm::vec3 pos, glm::vec3 oldPos, float radius);
+    void setCacheDirectory(const std::string& directory);
+    void setClusterCache(std::size_t limit, bool eager = false);
+    void setLightMapAtlasSize(int size);
+    void setFlatNodes(bool enabled);
+    void setAxialPlanes(bool enabled);
+    bool load(std::string fileName, ThreadPool* pool = NULL);
+
+    Bounds getWorldBounds() const;
+    const LumpArray<Vertex>& getVertices() const;
+    const LightMapAtlas& getLightMapAtlas() const;
+    const std::vector<LoadStage>& getLoadStages() const;
+    bool clusterVisible(int test, int cam);
+    int findLeaf(glm::vec3 &pos);
+    int findLeafCluster(glm::vec3 &pos);
+    LightVol findLightVol(const glm::vec3 &pos) const;
+    const LightGrid& getLightGrid() const;
+    const EntityList& getEntities() const;
 
-    friend struct Bezier;
-    friend struct Patch;
-    friend struct RenderPass;
-    friend struct TracePass;
+    void cullWorld(RenderPass &pass, bool solid);
+    void batchFaces(RenderPass &pass, bool sort, DrawList &list);
+    glm::vec3 traceWorld(glm::vec3 pos, glm::vec3 oldPos, float radius);
+    glm::vec3 traceWorld(TracePass &pass, glm::vec3 pos, glm::vec3 oldPos, float radius);
+    TraceResult traceSphere(glm::vec3 start, glm::vec3 end, float radius, int contentMask = MASK_PLAYERSOLID);
+    TraceResult traceSphere(SweepPass &pass, glm::vec3 start, glm::vec3 end, float radius, int contentMask = MASK_PLAYERSOLID);
+    TraceResult traceBox(glm::vec3 start, glm::vec3 end, glm::vec3 mins, glm::vec3 maxs, int contentMask = MASK_PLAYERSOLID);
+    TraceResult traceBox(SweepPass &pass, glm::vec3 start, glm::vec3 end, glm::vec3 mins, glm::vec3 maxs, int contentMask = MASK_PLAYERSOLID);
+    void traceWorld(const glm::vec3* positions, const glm::vec3* oldPositions, const float* radii, glm::vec3* out, int count, ThreadPool* pool = NULL);
+
+    friend class Renderer;
 };
 
 #endif // BSP_HPP
@@ -0,0 +1,93 @@
+#include "clustercache.hpp"
+
+ClusterCache::ClusterCache()
+    : hits(0)
+    , misses(0)
+    , evictions(0)
+    , bytes(0)
+    , maxBytes(0)
+{
+}
+
+void ClusterCache::reset(int clusterCount)
+{
+    entries.clear();
+    entries.resize(clusterCount > 0 ? clusterCount : 0);
+    for (std::size_t i = 0; i < entries.size(); i++)
+    {
+        entries[i].present = false;
+    }
+    recent.clear();
+    bytes = 0;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+}
+
+void ClusterCache::setLimit(std::size_t limit)
+{
+    maxBytes = limit;
+    evict(-1);
+}
+
+std::size_t ClusterCache::limit() const
+{
+    return maxBytes;
+}
+
+std::size_t ClusterCache::size() const
+{
+    return bytes;
+}
+
+const std::vector<int>* ClusterCache::find(int cluster)
+{
+    if (cluster < 0 || cluster >= (int)entries.size() || !entries[cluster].present)
+    {
+        misses++;
+        return NULL;
+    }
+
+    Entry& entry = entries[cluster];
+    recent.splice(recent.begin(), recent, entry.position);
+    hits++;
+    return &entry.faces;
+}
+
+// Takes the contents of faces. A list larger than the limit is still kept
+// until the next insert so the caller can use it.
+const std::vector<int>* ClusterCache::insert(int cluster, std::vector<int>& faces)
+{
+    if (cluster < 0 || cluster >= (int)entries.size())
+        return NULL;
+
+    Entry& entry = entries[cluster];
+    if (entry.present)
+    {
+        bytes -= entry.faces.capacity() * sizeof(int);
+        recent.erase(entry.position);
+    }
+
+    entry.faces.swap(faces);
+    std::vector<int>(entry.faces).swap(entry.faces);
+    entry.present = true;
+    recent.push_front(cluster);
+    entry.position = recent.begin();
+    bytes += entry.faces.capacity() * sizeof(int);
+
+    evict(cluster);
+    return &entry.faces;
+}
+
+void ClusterCache::evict(int keep)
+{
+    while (bytes > maxBytes && !recent.empty() && recent.back() != keep)
+    {
+        Entry& entry = entries[recent.back()];
+        bytes -= entry.faces.capacity() * sizeof(int);
+        std::vector<int>().swap(entry.faces);
+        entry.present = false;
+        recent.pop_back();
+        evictions++;
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef CLUSTERCACHE_HPP
+#define CLUSTERCACHE_HPP
+
+#include <cstddef>
+#include <list>
+#include <vector>
+
+// Face lists keyed by cluster, the least recently used lists are dropped
+// once the total size goes over the limit. Not thread safe.
+class ClusterCache
+{
+public:
+    ClusterCache();
+
+    void reset(int clusterCount);
+    void setLimit(std::size_t bytes);
+    std::size_t limit() const;
+    std::size_t size() const;
+
+    // Returns NULL when the cluster has no list, pointers stay valid until
+    // the next insert or reset
+    const std::vector<int>* find(int cluster);
+    const std::vector<int>* insert(int cluster, std::vector<int>& faces);
+
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int evictions;
+
+private:
+    struct Entry
+    {
+        bool present;
+        std::vector<int> faces;
+        std::list<int>::iterator position;
+    };
+
+    void evict(int keep);
+
+    std::vector<Entry> entries;
+    std::list<int> recent;
+    std::size_t bytes;
+    std::size_t maxBytes;
+};
+
+#endif // CLUSTERCACHE_HPP
@@ -0,0 +1,214 @@
+#include <cstdio>
+#include <cstring>
+#include "entities.hpp"
+
+bool EntityString::empty() const
+{
+    return length == 0;
+}
+
+bool EntityString::operator==(const char* text) const
+{
+    return strncmp(data ? data : "", text, length) == 0 && text[length] == '\0';
+}
+
+bool EntityString::operator!=(const char* text) const
+{
+    return !(*this == text);
+}
+
+enum TokenStatus
+{
+    TOKEN_OK = 0,
+    TOKEN_END,
+    TOKEN_ERROR
+};
+
+// The next token the way Q3 reads entity strings: quoted text without
+// escapes, or anything up to whitespace, with // and /* */ comments
+// skipped. A null character ends the text, a quote it cuts off is an
+// error.
+static TokenStatus nextToken(const char*& p, const char* end, EntityString& token, bool& quoted)
+{
+    for (;;)
+    {
+        while (p < end && *p != '\0' && (unsigned char)*p <= ' ')
+            p++;
+        if (p >= end || *p == '\0')
+            return TOKEN_END;
+        if (*p == '/' && p + 1 < end && p[1] == '/')
+        {
+            while (p < end && *p != '\0' && *p != '\n')
+                p++;
+        }
+        else if (*p == '/' && p + 1 < end && p[1] == '*')
+        {
+            p += 2;
+            while (p < end && *p != '\0' && !(*p == '*' && p + 1 < end && p[1] == '/'))
+                p++;
+            if (p < end && *p == '*')
+                p += 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    quoted = *p == '"';
+    if (quoted)
+    {
+        const char* start = ++p;
+        while (p < end && *p != '\0' && *p != '"')
+            p++;
+        token.data = start;
+        token.length = p - start;
+        if (p >= end || *p != '"')
+            return TOKEN_ERROR;
+        p++;
+        return TOKEN_OK;
+    }
+
+    const char* start = p;
+    while (p < end && (unsigned char)*p > ' ')
+        p++;
+    token.data = start;
+    token.length = p - start;
+    return TOKEN_OK;
+}
+
+bool EntityList::parse(const char* text, std::size_t size)
+{
+    clear();
+    const char* end = text + size;
+
+    // Braces and quotes give an upper bound on both counts, so the arrays
+    // are only allocated once
+    std::size_t braces = 0;
+    std::size_t quotes = 0;
+    for (const char* p = text; p < end; p++)
+    {
+        braces += *p == '{';
+        quotes += *p == '"';
+    }
+    entities.reserve(braces);
+    pairArray.reserve(quotes / 4);
+
+    const char* p = text;
+    EntityString token;
+    bool quoted;
+    for (;;)
+    {
+        TokenStatus status = nextToken(p, end, token, quoted);
+        if (status == TOKEN_END)
+            break;
+        if (status != TOKEN_OK || quoted || token != "{")
+        {
+            clear();
+            return false;
+        }
+
+        Entity entity;
+        entity.firstPair = (int)pairArray.size();
+        entity.pairCount = 0;
+        entity.className.data = NULL;
+        entity.className.length = 0;
+        for (;;)
+        {
+            EntityPair pair;
+            if (nextToken(p, end, pair.key, quoted) != TOKEN_OK)
+            {
+                clear();
+                return false;
+            }
+            if (!quoted && pair.key == "}")
+                break;
+            if (nextToken(p, end, pair.value, quoted) != TOKEN_OK || (!quoted && (pair.value == "{" || pair.value == "}")))
+            {
+                clear();
+                return false;
+            }
+            if (entity.className.data == NULL && pair.key == "classname")
+                entity.className = pair.value;
+            pairArray.push_back(pair);
+            entity.pairCount++;
+        }
+        entities.push_back(entity);
+    }
+    return true;
+}
+
+void EntityList::clear()
+{
+    entities.clear();
+    pairArray.clear();
+}
+
+std::size_t EntityList::size() const
+{
+    return entities.size();
+}
+
+const Entity& EntityList::operator[](std::size_t index) const
+{
+    return entities[index];
+}
+
+const EntityPair* EntityList::pairs(const Entity& entity) const
+{
+    return pairArray.empty() ? NULL : &pairArray[entity.firstPair];
+}
+
+int EntityList::find(const char* className, int after) const
+{
+    for (int i = after + 1; i < (int)entities.size(); i++)
+    {
+        if (entities[i].className == className)
+            return i;
+    }
+    return -1;
+}
+
+EntityString EntityList::value(int entity, const char* key) const
+{
+    const Entity& found = entities[entity];
+    for (int i = 0; i < found.pairCount; i++)
+    {
+        const EntityPair& pair = pairArray[found.firstPair + i];
+        if (pair.key == key)
+            return pair.value;
+    }
+    EntityString none = {NULL, 0};
+    return none;
+}
+
+// Three numbers separated by spaces, as in "origin" "0 0 64"
+bool EntityList::vector(int entity, const char* key, glm::vec3& out) const
+{
+    EntityString text = value(entity, key);
+    char buffer[64];
+    if (text.empty() || text.length >= sizeof(buffer))
+        return false;
+    memcpy(buffer, text.data, text.length);
+    buffer[text.length] = '\0';
+    float x, y, z;
+    if (sscanf(buffer, "%f %f %f", &x, &y, &z) != 3)
+        return false;
+    out = glm::vec3(x, y, z);
+    return true;
+}
+
+int EntityList::model(int entity) const
+{
+    EntityString text = value(entity, "model");
+    if (text.length < 2 || text.data[0] != '*')
+        return -1;
+    int index = 0;
+    for (std::size_t i = 1; i < text.length; i++)
+    {
+        if (text.data[i] < '0' || text.data[i] > '9' || index > 100000000)
+            return -1;
+        index = index * 10 + (text.data[i] - '0');
+    }
+    return index;
+}
@@ -0,0 +1,61 @@
+#ifndef ENTITIES_HPP
+#define ENTITIES_HPP
+
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+
+// A piece of the entity lump, not null terminated
+struct EntityString {
+    const char* data;
+    std::size_t length;
+
+    bool empty() const;
+    bool operator==(const char* text) const;
+    bool operator!=(const char* text) const;
+};
+
+struct EntityPair {
+    EntityString key;
+    EntityString value;
+};
+
+// pairCount pairs starting at firstPair, classname is empty if the entity
+// has none
+struct Entity {
+    int firstPair;
+    int pairCount;
+    EntityString className;
+};
+
+// The entity lump tokenized in place in one pass. Keys and values point
+// into the lump text, so only the entity and pair arrays are allocated.
+class EntityList
+{
+public:
+    // The text must outlive the list. Leaves the list empty and returns
+    // false if the text is not a list of { "key" "value" ... } blocks,
+    // including text cut off inside a quote or a block.
+    bool parse(const char* text, std::size_t size);
+    void clear();
+
+    std::size_t size() const;
+    const Entity& operator[](std::size_t index) const;
+    const EntityPair* pairs(const Entity& entity) const;
+
+    // Index of the next entity after the given one with this classname, -1
+    // if there is none
+    int find(const char* className, int after = -1) const;
+
+    // The first value for a key, empty if the entity does not have it
+    EntityString value(int entity, const char* key) const;
+    bool vector(int entity, const char* key, glm::vec3& out) const;
+    // The inline model of a "*N" model key, -1 for none
+    int model(int entity) const;
+
+private:
+    std::vector<Entity> entities;
+    std::vector<EntityPair> pairArray;
+};
+
+#endif // ENTITIES_HPP
@@ -1,7 +1,187 @@
-#include <iostream>
 #include <glm/glm.hpp>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FRUTSUM_X86
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #include "frutsum.hpp"
 
+#if defined(FRUTSUM_X86) && (defined(__GNUC__) || defined(__clang__))
+#define FRUTSUM_AVX2 __attribute__((target("avx2")))
+#else
+#define FRUTSUM_AVX2
+#endif
+
+typedef const float (*Planes)[8];
+typedef bool (*BoxKernel)(Planes planes, const Bounds& box);
+typedef int (*BatchKernel)(Planes planes, const Bounds* boxes, const int* indices, int count, int* out);
+
+// Picking the corner furthest along each plane normal is the same as
+// taking the larger of the two products per axis
+static inline bool boxScalar(Planes planes, const Bounds& box)
+{
+    for (int i = 0; i < 6; i++)
+    {
+        float x = planes[0][i] < 0 ? box.min.x : box.max.x;
+        float y = planes[1][i] < 0 ? box.min.y : box.max.y;
+        float z = planes[2][i] < 0 ? box.min.z : box.max.z;
+        if (planes[0][i] * x + planes[1][i] * y + planes[2][i] * z + planes[3][i] <= 0)
+            return false;
+    }
+    return true;
+}
+
+static int batchScalar(Planes planes, const Bounds* boxes, const int* indices, int count, int* out)
+{
+    int total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int index = indices ? indices[i] : i;
+        if (boxScalar(planes, boxes[index]))
+            out[total++] = index;
+    }
+    return total;
+}
+
+#ifdef FRUTSUM_X86
+static inline __m128 distancesSSE(Planes planes, int column, const Bounds& box)
+{
+    __m128 nx = _mm_loadu_ps(planes[0] + column);
+    __m128 ny = _mm_loadu_ps(planes[1] + column);
+    __m128 nz = _mm_loadu_ps(planes[2] + column);
+    __m128 w = _mm_loadu_ps(planes[3] + column);
+    __m128 x = _mm_max_ps(_mm_mul_ps(nx, _mm_set1_ps(box.max.x)), _mm_mul_ps(nx, _mm_set1_ps(box.min.x)));
+    __m128 y = _mm_max_ps(_mm_mul_ps(ny, _mm_set1_ps(box.max.y)), _mm_mul_ps(ny, _mm_set1_ps(box.min.y)));
+    __m128 z = _mm_max_ps(_mm_mul_ps(nz, _mm_set1_ps(box.max.z)), _mm_mul_ps(nz, _mm_set1_ps(box.min.z)));
+    return _mm_add_ps(_mm_add_ps(_mm_add_ps(x, y), z), w);
+}
+
+static inline bool boxSSE(Planes planes, const Bounds& box)
+{
+    __m128 zero = _mm_setzero_ps();
+    __m128 outside = _mm_or_ps(_mm_cmple_ps(distancesSSE(planes, 0, box), zero), _mm_cmple_ps(distancesSSE(planes, 4, box), zero));
+    return _mm_movemask_ps(outside) == 0;
+}
+
+static int batchSSE(Planes planes, const Bounds* boxes, const int* indices, int count, int* out)
+{
+    int total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int index = indices ? indices[i] : i;
+        if (boxSSE(planes, boxes[index]))
+            out[total++] = index;
+    }
+    return total;
+}
+
+// All six planes fit in one register, the last two lanes repeat plane 0
+FRUTSUM_AVX2 static inline bool boxAVX2(Planes planes, const Bounds& box)
+{
+    __m256 nx = _mm256_loadu_ps(planes[0]);
+    __m256 ny = _mm256_loadu_ps(planes[1]);
+    __m256 nz = _mm256_loadu_ps(planes[2]);
+    __m256 w = _mm256_loadu_ps(planes[3]);
+    __m256 x = _mm256_max_ps(_mm256_mul_ps(nx, _mm256_set1_ps(box.max.x)), _mm256_mul_ps(nx, _mm256_set1_ps(box.min.x)));
+    __m256 y = _mm256_max_ps(_mm256_mul_ps(ny, _mm256_set1_ps(box.max.y)), _mm256_mul_ps(ny, _mm256_set1_ps(box.min.y)));
+    __m256 z = _mm256_max_ps(_mm256_mul_ps(nz, _mm256_set1_ps(box.max.z)), _mm256_mul_ps(nz, _mm256_set1_ps(box.min.z)));
+    __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(x, y), z), w);
+    return _mm256_movemask_ps(_mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_LE_OQ)) == 0;
+}
+
+FRUTSUM_AVX2 static bool boxAVX2Call(Planes planes, const Bounds& box)
+{
+    return boxAVX2(planes, box);
+}
+
+FRUTSUM_AVX2 static int batchAVX2(Planes planes, const Bounds* boxes, const int* indices, int count, int* out)
+{
+    int total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int index = indices ? indices[i] : i;
+        if (boxAVX2(planes, boxes[index]))
+            out[total++] = index;
+    }
+    return total;
+}
+#endif
+
+static bool boxScalarCall(Planes planes, const Bounds& box)
+{
+    return boxScalar(planes, box);
+}
+
+#ifdef FRUTSUM_X86
+static bool boxSSECall(Planes planes, const Bounds& box)
+{
+    return boxSSE(planes, box);
+}
+#endif
+
+static bool cpuHasAVX2()
+{
+#if defined(FRUTSUM_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#elif defined(FRUTSUM_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+        return false;
+    if ((_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+static Frutsum::Kernel bestKernel()
+{
+    if (cpuHasAVX2())
+        return Frutsum::AVX2;
+#ifdef FRUTSUM_X86
+    return Frutsum::SSE;
+#else
+    return Frutsum::Scalar;
+#endif
+}
+
+// Only changed through setKernel, which is meant to be called before any
+// culling starts. Anything culled during static initialisation gets the
+// scalar kernel.
+static Frutsum::Kernel currentKernel = Frutsum::Scalar;
+static BoxKernel boxKernel = boxScalarCall;
+static BatchKernel batchKernel = batchScalar;
+
+static void selectKernel(Frutsum::Kernel kernel)
+{
+    currentKernel = kernel;
+    boxKernel = boxScalarCall;
+    batchKernel = batchScalar;
+#ifdef FRUTSUM_X86
+    if (kernel == Frutsum::SSE)
+    {
+        boxKernel = boxSSECall;
+        batchKernel = batchSSE;
+    }
+    else if (kernel == Frutsum::AVX2)
+    {
+        boxKernel = boxAVX2Call;
+        batchKernel = batchAVX2;
+    }
+#endif
+}
+
+static bool kernelPicked = Frutsum::setKernel(bestKernel());
+
 Frutsum::Frutsum(glm::mat4 matrix)
 {
     matrix = glm::transpose(matrix);
@@ -20,6 +200,15 @@ Frutsum::Frutsum(glm::mat4 matrix)
         }
         planes[i] = plane / glm::length(plane.xyz());
     }
+
+    for (int i = 0; i < 8; i++)
+    {
+        const glm::vec4& plane = planes[i < 6 ? i : 0];
+        soa[0][i] = plane.x;
+        soa[1][i] = plane.y;
+        soa[2][i] = plane.z;
+        soa[3][i] = plane.w;
+    }
 }
 
 bool Frutsum::inside(glm::vec3 pos)
@@ -36,25 +225,79 @@ bool Frutsum::inside(glm::vec3 pos)
 
 bool Frutsum::insideAABB(glm::vec3 max, glm::vec3 min)
 {
-    for (int i = 0; i < 6; i++)
+    Bounds bounds;
+    bounds.min = min;
+    bounds.max = max;
+    return insideAABB(bounds);
+}
+
+bool Frutsum::insideAABB(const Bounds& bounds) const
+{
+    return boxKernel(soa, bounds);
+}
+
+int Frutsum::insideAABBs(const Bounds* boxes, const int* indices, int count, int* out) const
+{
+    return batchKernel(soa, boxes, indices, count, out);
+}
+
+Frutsum::Containment Frutsum::classifyAABB(const Bounds& bounds, unsigned int& mask, unsigned char& lastPlane, unsigned int& tests) const
+{
+    if (mask == 0)
+        return Inside;
+
+    for (int n = 0; n < 6; n++)
     {
-        glm::vec3 pVert = max;
-        if (planes[i].x < 0)
-            pVert.x = min.x;
-        if (planes[i].y < 0)
-            pVert.y = min.y;
-        if (planes[i].z < 0)
-            pVert.z = min.z;
+        int i = n == 0 ? lastPlane : (n <= lastPlane ? n - 1 : n);
+        if (!(mask & (1u << i)))
+            continue;
+        tests++;
 
-        if (glm::dot(planes[i].xyz(), pVert) + planes[i].w <= 0)
+        const glm::vec4& plane = planes[i];
+        float x = plane.x < 0 ? bounds.min.x : bounds.max.x;
+        float y = plane.y < 0 ? bounds.min.y : bounds.max.y;
+        float z = plane.z < 0 ? bounds.min.z : bounds.max.z;
+        if (plane.x * x + plane.y * y + plane.z * z + plane.w <= 0)
         {
-            return false;
+            lastPlane = i;
+            return Outside;
         }
+
+        x = plane.x < 0 ? bounds.max.x : bounds.min.x;
+        y = plane.y < 0 ? bounds.max.y : bounds.min.y;
+        z = plane.z < 0 ? bounds.max.z : bounds.min.z;
+        if (plane.x * x + plane.y * y + plane.z * z + plane.w > 0)
+            mask &= ~(1u << i);
     }
+    return mask == 0 ? Inside : Intersecting;
+}
+
+Frutsum::Kernel Frutsum::kernel()
+{
+    return currentKernel;
+}
+
+bool Frutsum::setKernel(Kernel kernel)
+{
+    if (!kernelSupported(kernel))
+        return false;
+    selectKernel(kernel);
     return true;
 }
 
-bool Frutsum::insideAABB(int *max, int *min)
+bool Frutsum::kernelSupported(Kernel kernel)
 {
-    return insideAABB(glm::vec3(max[0], max[1], max[2]), glm::vec3(min[0], min[1], min[2]));
+    switch (kernel)
+    {
+    case Scalar:
+        return true;
+#ifdef FRUTSUM_X86
+    case SSE:
+        return true;
+    case AVX2:
+        return cpuHasAVX2();
+#endif
+    default:
+        return false;
+    }
 }
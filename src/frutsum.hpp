@@ -3,16 +3,57 @@
 
 #include <glm/glm.hpp>
 
+struct Bounds {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
 class Frutsum
 {
 private:
     glm::vec4 planes[6];
 
+    // The same planes as four rows of x, y, z and w, padded to eight
+    // columns by repeating the first plane
+    float soa[4][8];
+
 public:
+    enum Kernel
+    {
+        Scalar,
+        SSE,
+        AVX2
+    };
+
+    enum Containment
+    {
+        Outside,
+        Intersecting,
+        Inside
+    };
+
+    static const unsigned int ALLPLANES = 0x3f;
+
     Frutsum(glm::mat4 matrix);
     bool inside(glm::vec3 pos);
     bool insideAABB(glm::vec3 max, glm::vec3 min);
-    bool insideAABB(int *max, int *min);
+    bool insideAABB(const Bounds& bounds) const;
+
+    // Tests boxes[indices[i]] for each i, or boxes[i] when indices is NULL,
+    // and writes the indices of the boxes inside to out. Returns how many
+    // were written.
+    int insideAABBs(const Bounds* boxes, const int* indices, int count, int* out) const;
+
+    // Only tests the planes in mask and clears the ones the box is fully
+    // inside of, so children of the box can skip them. The test starts at
+    // lastPlane, which is set to the plane the box is rejected by. tests is
+    // increased by the number of planes tested.
+    Containment classifyAABB(const Bounds& bounds, unsigned int& mask, unsigned char& lastPlane, unsigned int& tests) const;
+
+    // Picked at startup from the best the CPU supports
+    static Kernel kernel();
+    static bool setKernel(Kernel kernel);
+    static bool kernelSupported(Kernel kernel);
 };
 
 #endif // FRUTSUM_HPP
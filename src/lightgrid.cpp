@@ -0,0 +1,353 @@
+#include <cmath>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LIGHTGRID_SSE2
+#include <emmintrin.h>
+#endif
+#include "bsp.hpp"
+#include "lightgrid.hpp"
+
+static const float CELL_SIZE[3] = {64.f, 64.f, 128.f};
+
+static_assert(sizeof(PackedLightVol) == 8, "the batch reads cells as eight bytes");
+
+// Unit vectors for every longitude and latitude pair, indexed by
+// direction[0] * 256 + direction[1]. Padded by a float so the last one can
+// be read as four.
+static const float* directionTable()
+{
+    static const std::vector<float> table = []()
+    {
+        const float PI = 3.14159265359f;
+        std::vector<float> directions(256 * 256 * 3 + 1, 0.f);
+        for (int i = 0; i < 256; i++)
+        {
+            float longitude = i * (2.f * PI / 256.f);
+            for (int j = 0; j < 256; j++)
+            {
+                float latitude = j * (2.f * PI / 256.f);
+                float* direction = &directions[(i * 256 + j) * 3];
+                direction[0] = std::cos(latitude) * std::sin(longitude);
+                direction[1] = std::sin(latitude) * std::sin(longitude);
+                direction[2] = std::cos(longitude);
+            }
+        }
+        return directions;
+    }();
+    return &table[0];
+}
+
+static inline const float* cellDirection(const float* table, const PackedLightVol& cell)
+{
+    return table + (cell.direction[0] * 256 + cell.direction[1]) * 3;
+}
+
+// Colours are stored as 256ths
+static void decode(const float* table, const PackedLightVol& cell, LightVol& out)
+{
+    const float* direction = cellDirection(table, cell);
+    for (int i = 0; i < 3; i++)
+    {
+        out.ambient[i] = cell.ambient[i] * (1.f / 256.f);
+        out.directional[i] = cell.directional[i] * (1.f / 256.f);
+        out.direction[i] = direction[i];
+    }
+}
+
+// Points outside the grid take the edge cells. A point on the last cell
+// has nothing past it to blend with, so it takes that cell alone.
+static void cellCoordinate(float v, int size, float& base, float& frac)
+{
+    float last = float(size - 1);
+    base = std::floor(v);
+    frac = v - base;
+    if (!(base >= 0.f))
+    {
+        base = 0.f;
+        frac = 0.f;
+    }
+    else if (base >= last)
+    {
+        base = last;
+        frac = 0.f;
+    }
+}
+
+LightGrid::LightGrid()
+    : cells(NULL)
+    , directions(NULL)
+    , origin(0.f)
+    , inverseCellSize(1.f)
+{
+    size[0] = size[1] = size[2] = 0;
+}
+
+bool LightGrid::build(const glm::vec3& worldMin, const glm::vec3& worldMax, const PackedLightVol* cells, std::size_t count)
+{
+    this->cells = NULL;
+    size[0] = size[1] = size[2] = 0;
+
+    int cellSize[3];
+    std::size_t total = 1;
+    for (int i = 0; i < 3; i++)
+    {
+        float first = std::ceil(worldMin[i] / CELL_SIZE[i]);
+        cellSize[i] = int(std::floor(worldMax[i] / CELL_SIZE[i]) - first + 1);
+        origin[i] = first * CELL_SIZE[i];
+        inverseCellSize[i] = 1.f / CELL_SIZE[i];
+        if (cellSize[i] <= 0)
+            return false;
+        total *= cellSize[i];
+    }
+    if (cells == NULL || total != count)
+        return false;
+
+    this->cells = cells;
+    directions = directionTable();
+    for (int i = 0; i < 3; i++)
+        size[i] = cellSize[i];
+    return true;
+}
+
+bool LightGrid::empty() const
+{
+    return cells == NULL;
+}
+
+// The cell a point is in, without blending
+LightVol LightGrid::nearest(const glm::vec3& position) const
+{
+    LightVol result;
+    result.ambient = glm::vec3(0.f);
+    result.directional = glm::vec3(0.f);
+    result.direction = glm::vec3(0.f);
+    if (cells == NULL)
+        return result;
+
+    int index = 0;
+    int step = 1;
+    for (int i = 0; i < 3; i++)
+    {
+        float base;
+        float frac;
+        cellCoordinate((position[i] - origin[i]) * inverseCellSize[i], size[i], base, frac);
+        index += int(base) * step;
+        step *= size[i];
+    }
+    decode(directions, cells[index], result);
+    return result;
+}
+
+void LightGrid::sample(const glm::vec3& position, LightVol& out) const
+{
+    glm::vec3 ambient(0.f);
+    glm::vec3 directional(0.f);
+    glm::vec3 direction(0.f);
+    float total = 0.f;
+
+    if (cells != NULL)
+    {
+        float base[3];
+        float frac[3];
+        int first = 0;
+        int step[3] = {1, size[0], size[0] * size[1]};
+        for (int i = 0; i < 3; i++)
+        {
+            cellCoordinate((position[i] - origin[i]) * inverseCellSize[i], size[i], base[i], frac[i]);
+            first += int(base[i]) * step[i];
+        }
+
+        for (int corner = 0; corner < 8; corner++)
+        {
+            float weight = 1.f;
+            int index = first;
+            int i = 0;
+            for (; i < 3; i++)
+            {
+                if (corner & (1 << i))
+                {
+                    if (base[i] >= float(size[i] - 1))
+                        break;
+                    weight *= frac[i];
+                    index += step[i];
+                }
+                else
+                {
+                    weight *= 1.f - frac[i];
+                }
+            }
+            if (i != 3)
+                continue;
+
+            const PackedLightVol& packed = cells[index];
+            if (packed.ambient[0] + packed.ambient[1] + packed.ambient[2] == 0)
+                continue;
+            LightVol cell;
+            decode(directions, packed, cell);
+            total += weight;
+            ambient += cell.ambient * weight;
+            directional += cell.directional * weight;
+            direction += cell.direction * weight;
+        }
+    }
+
+    if (total > 0.f)
+    {
+        ambient /= total;
+        directional /= total;
+    }
+    float length = std::sqrt(direction.x * direction.x + direction.y * direction.y + direction.z * direction.z);
+    direction = length > 0.f ? direction / length : glm::vec3(0.f);
+
+    out.ambient = ambient;
+    out.directional = directional;
+    out.direction = direction;
+}
+
+#ifdef LIGHTGRID_SSE2
+// Only for values well inside the int range
+static inline __m128 floorFour(__m128 v)
+{
+    __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+    return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, v), _mm_set1_ps(1.f)));
+}
+#endif
+
+// Four positions go through the same steps as sample() one per lane, only
+// the cells and their directions are gathered one at a time, so results are
+// the same as sample() up to rounding.
+void LightGrid::sample(const LightGridBatch& batch, int count) const
+{
+    int first = 0;
+#ifdef LIGHTGRID_SSE2
+    if (cells != NULL)
+    {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.f);
+        int step[3] = {1, size[0], size[0] * size[1]};
+
+        for (; first + 4 <= count; first += 4)
+        {
+            __m128 frac[3];
+            __m128 next[3];
+            int index[4] = {0, 0, 0, 0};
+            for (int i = 0; i < 3; i++)
+            {
+                __m128 last = _mm_set1_ps(float(size[i] - 1));
+                __m128 v = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(batch.position[i] + first), _mm_set1_ps(origin[i])), _mm_set1_ps(inverseCellSize[i]));
+                // Anything past the edges ends up clamped the same way, NaN
+                // included
+                v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(-1.f)), _mm_add_ps(last, one));
+
+                __m128 base = floorFour(v);
+                __m128 f = _mm_sub_ps(v, base);
+                __m128 below = _mm_cmplt_ps(base, zero);
+                __m128 above = _mm_cmpge_ps(base, last);
+                __m128 clamped = _mm_or_ps(below, above);
+                base = _mm_or_ps(_mm_andnot_ps(clamped, base), _mm_and_ps(above, last));
+                frac[i] = _mm_andnot_ps(clamped, f);
+                next[i] = _mm_cmplt_ps(base, last);
+
+                int lanes[4];
+                _mm_storeu_si128((__m128i*)lanes, _mm_cvttps_epi32(base));
+                for (int k = 0; k < 4; k++)
+                    index[k] += lanes[k] * step[i];
+            }
+
+            __m128 total = zero;
+            __m128 sums[9];
+            for (int j = 0; j < 9; j++)
+                sums[j] = zero;
+
+            for (int corner = 0; corner < 8; corner++)
+            {
+                __m128 weight = one;
+                __m128 valid = _mm_castsi128_ps(_mm_set1_epi32(-1));
+                int offset = 0;
+                for (int i = 0; i < 3; i++)
+                {
+                    if (corner & (1 << i))
+                    {
+                        weight = _mm_mul_ps(weight, frac[i]);
+                        valid = _mm_and_ps(valid, next[i]);
+                        offset += step[i];
+                    }
+                    else
+                    {
+                        weight = _mm_mul_ps(weight, _mm_sub_ps(one, frac[i]));
+                    }
+                }
+
+                // Lanes past the edge read the first cell and weigh nothing.
+                // The four cells' bytes are transposed so each component
+                // ends up in one register.
+                int lanes = _mm_movemask_ps(valid);
+                const PackedLightVol* cell[4];
+                for (int k = 0; k < 4; k++)
+                    cell[k] = &cells[(lanes & (1 << k)) ? index[k] + offset : 0];
+
+                __m128i pairs01 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)cell[0]), _mm_loadl_epi64((const __m128i*)cell[1]));
+                __m128i pairs23 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)cell[2]), _mm_loadl_epi64((const __m128i*)cell[3]));
+                __m128i bytes[2] = {_mm_unpacklo_epi16(pairs01, pairs23), _mm_unpackhi_epi16(pairs01, pairs23)};
+
+                __m128 cellValues[9];
+                for (int j = 0; j < 6; j++)
+                {
+                    __m128i block = bytes[j / 4];
+                    __m128i words = (j % 4) < 2 ? _mm_unpacklo_epi8(block, _mm_setzero_si128()) : _mm_unpackhi_epi8(block, _mm_setzero_si128());
+                    __m128i values = (j % 2) ? _mm_unpackhi_epi16(words, _mm_setzero_si128()) : _mm_unpacklo_epi16(words, _mm_setzero_si128());
+                    cellValues[j] = _mm_mul_ps(_mm_cvtepi32_ps(values), _mm_set1_ps(1.f / 256.f));
+                }
+
+                __m128 row[4];
+                for (int k = 0; k < 4; k++)
+                    row[k] = _mm_loadu_ps(cellDirection(directions, *cell[k]));
+                _MM_TRANSPOSE4_PS(row[0], row[1], row[2], row[3]);
+                cellValues[6] = row[0];
+                cellValues[7] = row[1];
+                cellValues[8] = row[2];
+
+                __m128 ambient = _mm_add_ps(_mm_add_ps(cellValues[0], cellValues[1]), cellValues[2]);
+                weight = _mm_and_ps(weight, _mm_and_ps(valid, _mm_cmpneq_ps(ambient, zero)));
+
+                total = _mm_add_ps(total, weight);
+                for (int j = 0; j < 9; j++)
+                    sums[j] = _mm_add_ps(sums[j], _mm_mul_ps(cellValues[j], weight));
+            }
+
+            __m128 lit = _mm_cmpgt_ps(total, zero);
+            total = _mm_or_ps(_mm_and_ps(lit, total), _mm_andnot_ps(lit, one));
+            for (int j = 0; j < 6; j++)
+                sums[j] = _mm_div_ps(sums[j], total);
+
+            __m128 length = _mm_mul_ps(sums[6], sums[6]);
+            length = _mm_add_ps(length, _mm_mul_ps(sums[7], sums[7]));
+            length = _mm_add_ps(length, _mm_mul_ps(sums[8], sums[8]));
+            length = _mm_sqrt_ps(length);
+            __m128 pointing = _mm_cmpgt_ps(length, zero);
+            length = _mm_or_ps(_mm_and_ps(pointing, length), _mm_andnot_ps(pointing, one));
+            for (int j = 6; j < 9; j++)
+                sums[j] = _mm_and_ps(pointing, _mm_div_ps(sums[j], length));
+
+            for (int j = 0; j < 3; j++)
+            {
+                _mm_storeu_ps(batch.ambient[j] + first, sums[j]);
+                _mm_storeu_ps(batch.directional[j] + first, sums[3 + j]);
+                _mm_storeu_ps(batch.direction[j] + first, sums[6 + j]);
+            }
+        }
+    }
+#endif
+
+    for (; first < count; first++)
+    {
+        LightVol result;
+        sample(glm::vec3(batch.position[0][first], batch.position[1][first], batch.position[2][first]), result);
+        for (int j = 0; j < 3; j++)
+        {
+            batch.ambient[j][first] = result.ambient[j];
+            batch.directional[j][first] = result.directional[j];
+            batch.direction[j][first] = result.direction[j];
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef LIGHTGRID_HPP
+#define LIGHTGRID_HPP
+
+#include <cstddef>
+#include <glm/glm.hpp>
+
+struct LightVol;
+struct PackedLightVol;
+
+// Positions in and light out as one array of count floats per component,
+// so batches can be sampled four at a time
+struct LightGridBatch {
+    const float* position[3];
+    float* ambient[3];
+    float* directional[3];
+    float* direction[3];
+};
+
+// The lightvol lump as a grid of 64x64x128 cells starting at the first cell
+// boundary inside the world model. Samples blend the eight cells around a
+// point, leaving out cells past the edge of the grid and cells inside
+// walls, which have no ambient light, the same way Q3 does. Cells stay in
+// their 8 byte form and are decoded as they are sampled, directions come
+// from a table shared by every grid.
+class LightGrid
+{
+public:
+    LightGrid();
+
+    // Leaves the grid empty if count does not match the world bounds. The
+    // cells are not copied.
+    bool build(const glm::vec3& worldMin, const glm::vec3& worldMax, const PackedLightVol* cells, std::size_t count);
+
+    bool empty() const;
+    LightVol nearest(const glm::vec3& position) const;
+    void sample(const glm::vec3& position, LightVol& out) const;
+    void sample(const LightGridBatch& batch, int count) const;
+
+private:
+    const PackedLightVol* cells;
+    const float* directions;
+    int size[3];
+    glm::vec3 origin;
+    glm::vec3 inverseCellSize;
+};
+
+#endif // LIGHTGRID_HPP
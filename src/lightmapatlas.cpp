@@ -0,0 +1,99 @@
+#include <algorithm>
+#include <cstring>
+#include "bsp.hpp"
+#include "lightmapatlas.hpp"
+
+static int powerOfTwo(int value)
+{
+    int result = 1;
+    while (result < value)
+        result *= 2;
+    return result;
+}
+
+LightMapAtlas::LightMapAtlas()
+    : columns(1)
+    , rows(1)
+    , pages(1)
+    , cells(1)
+{
+}
+
+// Pages are kept to power of two sizes no larger than maxSize on a side,
+// or a single cell if maxSize is smaller than that
+void LightMapAtlas::build(int lightMapCount, int maxSize)
+{
+    cells = lightMapCount + 1;
+    int side = 1;
+    while (side * 2 <= maxSize / LIGHTMAP_SIZE)
+        side *= 2;
+
+    columns = 1;
+    while (columns < side && columns * columns < cells)
+        columns *= 2;
+    rows = std::min(powerOfTwo((cells + columns - 1) / columns), side);
+    pages = (cells + columns * rows - 1) / (columns * rows);
+}
+
+int LightMapAtlas::width() const
+{
+    return columns * LIGHTMAP_SIZE;
+}
+
+int LightMapAtlas::height() const
+{
+    return rows * LIGHTMAP_SIZE;
+}
+
+int LightMapAtlas::page(int lightMap) const
+{
+    return lightMap / (columns * rows);
+}
+
+// Coordinates stay half a texel inside the cell, where a lightmap of its
+// own would have been clamped, so filtering never reaches the next cell.
+// The fallback cell is a flat colour, so all of its faces point at the
+// middle of it.
+glm::vec2 LightMapAtlas::remap(int lightMap, glm::vec2 coord) const
+{
+    if (lightMap == cells - 1)
+        coord = glm::vec2(0.5f, 0.5f);
+    const float edge = 0.5f / LIGHTMAP_SIZE;
+    float u = std::min(std::max(coord.x, edge), 1.f - edge);
+    float v = std::min(std::max(coord.y, edge), 1.f - edge);
+
+    int cell = lightMap % (columns * rows);
+    float x = (cell % columns + u) / columns;
+    float y = (cell / columns + v) / rows;
+    return glm::vec2(x, y);
+}
+
+void LightMapAtlas::copyPage(int page, const LightMap* lightMaps, int lightMapCount, unsigned char* pixels) const
+{
+    int pageWidth = width();
+    memset(pixels, 0, (std::size_t)pageWidth * height() * 4);
+
+    int first = page * columns * rows;
+    int last = std::min(first + columns * rows, cells);
+    for (int i = first; i < last; i++)
+    {
+        int cell = i - first;
+        unsigned char* corner = pixels + ((std::size_t)(cell / columns) * LIGHTMAP_SIZE * pageWidth + (cell % columns) * LIGHTMAP_SIZE) * 4;
+        for (int y = 0; y < LIGHTMAP_SIZE; y++)
+        {
+            unsigned char* row = corner + (std::size_t)y * pageWidth * 4;
+            if (i < lightMapCount)
+            {
+                memcpy(row, lightMaps[i].data + y * LIGHTMAP_SIZE * 4, LIGHTMAP_SIZE * 4);
+                continue;
+            }
+            for (int x = 0; x < LIGHTMAP_SIZE; x++)
+            {
+                row[x * 4 + 0] = 85;
+                row[x * 4 + 1] = 85;
+                row[x * 4 + 2] = 85;
+                row[x * 4 + 3] = 255;
+            }
+        }
+    }
+}
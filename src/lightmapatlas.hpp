@@ -0,0 +1,31 @@
+#ifndef LIGHTMAPATLAS_HPP
+#define LIGHTMAPATLAS_HPP
+
+#include <glm/glm.hpp>
+
+struct LightMap;
+
+const int LIGHTMAP_SIZE = 128;
+
+// Packs the 128x128 lightmaps into pages of columns x rows cells, edge to
+// edge. The cell after the last lightmap is a grey fallback used by faces
+// without one.
+struct LightMapAtlas {
+    int columns;
+    int rows;
+    int pages;
+    int cells;
+
+    LightMapAtlas();
+
+    void build(int lightMapCount, int maxSize);
+    int width() const;
+    int height() const;
+    int page(int lightMap) const;
+    glm::vec2 remap(int lightMap, glm::vec2 coord) const;
+
+    // Fills an RGBA page of width() x height() pixels
+    void copyPage(int page, const LightMap* lightMaps, int lightMapCount, unsigned char* pixels) const;
+};
+
+#endif // LIGHTMAPATLAS_HPP
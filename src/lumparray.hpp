@@ -0,0 +1,88 @@
+#ifndef LUMPARRAY_HPP
+#define LUMPARRAY_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// Read-only array of lump records. It either points straight into a
+// mapped file or, when the data cannot be used in place, owns a copy.
+template <typename T>
+class LumpArray
+{
+private:
+    const T* items;
+    std::size_t count;
+    std::vector<T> storage;
+
+public:
+    LumpArray()
+        : items(NULL)
+        , count(0)
+    {
+    }
+
+    // Points the array at existing memory, which must outlive it
+    void assign(const T* data, std::size_t size)
+    {
+        std::vector<T>().swap(storage);
+        items = data;
+        count = size;
+    }
+
+    // Copies size records from possibly unaligned memory
+    void copy(const void* data, std::size_t size)
+    {
+        storage.resize(size);
+        if (size > 0)
+            memcpy(&storage[0], data, size * sizeof(T));
+        items = size > 0 ? &storage[0] : NULL;
+        count = size;
+    }
+
+    // Takes over the contents of a vector built at load time
+    void take(std::vector<T>& data)
+    {
+        storage.swap(data);
+        std::vector<T>().swap(data);
+        items = storage.empty() ? NULL : &storage[0];
+        count = storage.size();
+    }
+
+    void clear()
+    {
+        assign(NULL, 0);
+    }
+
+    bool isView() const
+    {
+        return items != NULL && storage.empty();
+    }
+
+    std::size_t size() const
+    {
+        return count;
+    }
+
+    const T* data() const
+    {
+        return items;
+    }
+
+    const T& operator[](std::size_t index) const
+    {
+        return items[index];
+    }
+
+    const T* begin() const
+    {
+        return items;
+    }
+
+    const T* end() const
+    {
+        return items + count;
+    }
+};
+
+#endif // LUMPARRAY_HPP
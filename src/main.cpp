@@ -1,10 +1,16 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <physfs.h>
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <SFML/Window.hpp>
+#include <SFML/Graphics/Texture.hpp>
 #include "bsp.hpp"
+#include "profiler.hpp"
+#include "renderer.hpp"
 
 #define PI 3.14159265359f
 
@@ -70,12 +76,27 @@ int main(int argc, char *argv[])
 
     glewInit();
 
+    ThreadPool pool;
+
     Map map;
-    if (!map.load(argv[2]))
+    map.setLightMapAtlasSize(std::min(2048u, sf::Texture::getMaximumSize()));
+    if (getenv("BSPVIEWER_CACHE"))
+    {
+        map.setCacheDirectory(getenv("BSPVIEWER_CACHE"));
+    }
+    if (getenv("BSPVIEWER_CLUSTERCACHE"))
+    {
+        map.setClusterCache((std::size_t)atoi(getenv("BSPVIEWER_CLUSTERCACHE")) * 1024 * 1024);
+    }
+    if (!map.load(argv[2], &pool))
     {
         return -1;
     }
 
+    Renderer renderer(map, &pool);
+    renderer.load();
+    PROFILE_END_LOAD();
+
     glClearColor(0.f, 0.f, 0.f, 0.f);
     glClearDepth(1.f);
 
@@ -85,6 +106,23 @@ int main(int argc, char *argv[])
     float pitch = 0.f;
     bool collision = false;
 
+    // Start on the first spawn point. Q3 angles turn the other way round.
+    const EntityList& entities = map.getEntities();
+    int spawn = entities.find("info_player_deathmatch");
+    if (spawn < 0)
+        spawn = entities.find("info_player_start");
+    if (spawn >= 0 && entities.vector(spawn, "origin", position))
+    {
+        EntityString angle = entities.value(spawn, "angle");
+        if (!angle.empty())
+            yaw = -(float)atof(std::string(angle.data, angle.length).c_str());
+        if (yaw < -180.f) yaw += 360.f;
+    }
+
+    // Camera paths for bspbench -path
+    const char* recordFile = getenv("BSPVIEWER_RECORD") ? getenv("BSPVIEWER_RECORD") : "camera.path";
+    std::ofstream record;
+
     while (window.isOpen())
     {
         // Events
@@ -115,6 +153,29 @@ int main(int argc, char *argv[])
                 case sf::Keyboard::E:
                     collision = !collision;
                     break;
+                case sf::Keyboard::R:
+                    if (record.is_open())
+                    {
+                        record.close();
+                        std::cout << "Stopped recording" << std::endl;
+                        break;
+                    }
+                    record.open(recordFile);
+                    if (!record)
+                    {
+                        std::cout << recordFile << ": could not open" << std::endl;
+                        break;
+                    }
+                    record.precision(9);
+                    record << "# x y z yaw pitch moveX moveY moveZ" << std::endl;
+                    std::cout << "Recording to " << recordFile << std::endl;
+                    break;
+#ifdef BSP_PROFILE
+                case sf::Keyboard::P:
+                    if (Profiler::instance().writeChromeTrace("bspviewer.trace.json"))
+                        std::cout << "Wrote bspviewer.trace.json" << std::endl;
+                    break;
+#endif
                 case sf::Keyboard::Escape:
                     window.close();
                     break;
@@ -149,9 +210,16 @@ int main(int argc, char *argv[])
         if (sf::Keyboard::isKeyPressed(sf::Keyboard::LShift))
             position -= up * elapsed * speed;
 
+        glm::vec3 move = position;
         if (collision)
             position = map.traceWorld(position, oldPos, 10.f);
 
+        if (record.is_open())
+        {
+            record << position.x << ' ' << position.y << ' ' << position.z << ' ' << yaw << ' ' << pitch
+                   << ' ' << move.x << ' ' << move.y << ' ' << move.z << '\n';
+        }
+
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         glm::mat4 view = glm::perspective(deg2rad(75.f), float(width) / float(height), 1.f, 9000.f);
@@ -160,9 +228,10 @@ int main(int argc, char *argv[])
         view = glm::rotate(view, deg2rad(yaw + 90.f), glm::vec3(0.f, 0.f, 1.f));
         view = glm::translate(view, -position);
 
-        map.renderWorld(view, position);
+        renderer.renderWorld(view, position);
 
         window.display();
+        PROFILE_FRAME();
     }
 
     return 0;
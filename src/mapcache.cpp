@@ -0,0 +1,203 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include "bsp.hpp"
+#include "mapcache.hpp"
+#include "profiler.hpp"
+
+std::uint64_t hashData(const char* data, std::size_t size)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ULL ^ size;
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        std::uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 32;
+    hash *= 0xd6e8feb86659fd93ULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+template <typename T>
+static bool mapSection(const MappedFile& file, const CacheSection& section, LumpArray<T>& array)
+{
+    if (section.offset % CACHE_ALIGNMENT != 0 || section.size % sizeof(T) != 0)
+        return false;
+    if (section.offset > file.size() || section.size > file.size() - section.offset)
+        return false;
+    array.assign(reinterpret_cast<const T*>(file.data() + section.offset), section.size / sizeof(T));
+    return true;
+}
+
+template <typename T>
+static void writeSection(FILE* out, CacheSection& section, const LumpArray<T>& array)
+{
+    long position = ftell(out);
+    while (position % CACHE_ALIGNMENT != 0)
+    {
+        fputc(0, out);
+        position++;
+    }
+    section.offset = position;
+    section.size = array.size() * sizeof(T);
+    if (array.size() > 0)
+        fwrite(array.data(), sizeof(T), array.size(), out);
+}
+
+std::string Map::cachePath(std::uint64_t hash)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx-%d-%d.bspc", (unsigned long long)hash, bezierLevel, lightMapAtlasSize);
+    std::string path = cacheDirectory;
+    if (path.length() > 0 && path[path.length() - 1] != '/' && path[path.length() - 1] != '\\')
+        path.append("/");
+    return path + name;
+}
+
+bool Map::loadCache(std::uint64_t hash, int faceCount, int lightMapCount)
+{
+    PROFILE_ZONE("Map::loadCache");
+    if (!cacheFile.openHost(cachePath(hash)))
+        return false;
+
+    CacheHeader header;
+    bool valid = cacheFile.size() >= sizeof(CacheHeader);
+    if (valid)
+    {
+        memcpy(&header, cacheFile.data(), sizeof(CacheHeader));
+        valid = memcmp(header.magic, "BSPC", 4) == 0
+            && header.version == CACHE_VERSION
+            && header.hash == hash
+            && header.bezierLevel == bezierLevel
+            && header.lightMapAtlasSize == lightMapAtlasSize
+            && header.vertexSize == (int)sizeof(Vertex)
+            && header.faceSize == (int)sizeof(Face)
+            && header.patchSize == (int)sizeof(PatchFace)
+            && header.patchGroupSize == (int)sizeof(PatchGroup)
+            && header.clusterCount == visData.clusterCount
+            && header.bytesPerCluster == visData.bytesPerCluster;
+    }
+
+    valid = valid
+        && mapSection(cacheFile, header.sections[CACHE_FACE], faceArray)
+        && mapSection(cacheFile, header.sections[CACHE_VERTEX], vertexArray)
+        && mapSection(cacheFile, header.sections[CACHE_MESHINDEX], meshIndexArray)
+        && mapSection(cacheFile, header.sections[CACHE_VISDATA], visData.words)
+        && mapSection(cacheFile, header.sections[CACHE_LIGHTMAP], lightMapArray)
+        && mapSection(cacheFile, header.sections[CACHE_PATCHVERTEX], patchVertexArray)
+        && mapSection(cacheFile, header.sections[CACHE_PATCHINDEX], patchIndexArray)
+        && mapSection(cacheFile, header.sections[CACHE_FACEPATCH], facePatches)
+        && mapSection(cacheFile, header.sections[CACHE_PATCH], patchArray)
+        && mapSection(cacheFile, header.sections[CACHE_PATCHGROUP], patchGroupArray)
+        && mapSection(cacheFile, header.sections[CACHE_FACEBOUNDS], faceBoundsArray);
+
+    valid = valid
+        && faceArray.size() == (std::size_t)faceCount
+        && lightMapArray.size() == (std::size_t)lightMapCount
+        && facePatches.size() == (std::size_t)faceCount
+        && faceBoundsArray.size() == (std::size_t)faceCount
+        && visData.words.size() == (visData.bytesPerCluster > 0 ? (std::size_t)visData.clusterCount * visData.wordsPerCluster : 0);
+
+    for (std::size_t i = 0; valid && i < faceArray.size(); i++)
+    {
+        const Face& face = faceArray[i];
+        valid = face.meshIndexOffset >= 0 && face.meshIndexCount >= 0
+            && (std::size_t)face.meshIndexOffset + face.meshIndexCount <= meshIndexArray.size()
+            && face.lightMap >= 0 && face.lightMap <= lightMapCount
+            && facePatches[i] >= -1 && facePatches[i] < (int)patchArray.size();
+    }
+
+    // Patch indices come after the mesh indices, see preparePatches
+    for (std::size_t i = 0; valid && i < patchArray.size(); i++)
+    {
+        const PatchFace& patch = patchArray[i];
+        valid = patch.group >= 0 && patch.group < (int)patchGroupArray.size();
+        for (int level = 0; valid && level < PATCH_LEVELCOUNT; level++)
+        {
+            valid = patch.meshIndexOffset[level] >= 0 && patch.meshIndexCount[level] >= 0
+                && (std::size_t)patch.meshIndexOffset[level] >= meshIndexArray.size()
+                && (std::size_t)patch.meshIndexOffset[level] + patch.meshIndexCount[level] <= meshIndexArray.size() + patchIndexArray.size();
+        }
+    }
+
+    if (!valid)
+    {
+        faceArray.clear();
+        vertexArray.clear();
+        meshIndexArray.clear();
+        visData.words.clear();
+        lightMapArray.clear();
+        patchVertexArray.clear();
+        patchIndexArray.clear();
+        facePatches.clear();
+        patchArray.clear();
+        patchGroupArray.clear();
+        faceBoundsArray.clear();
+        cacheFile.close();
+    }
+    return valid;
+}
+
+// Written to a temporary file first so a half written cache is never
+// picked up by another process
+void Map::saveCache(std::uint64_t hash)
+{
+    PROFILE_ZONE("Map::saveCache");
+    std::string path = cachePath(hash);
+    std::string temporary = path + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (!out)
+    {
+        std::cout << path << ": Could not write cache" << std::endl;
+        return;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(CacheHeader));
+    memcpy(header.magic, "BSPC", 4);
+    header.version = CACHE_VERSION;
+    header.hash = hash;
+    header.bezierLevel = bezierLevel;
+    header.lightMapAtlasSize = lightMapAtlasSize;
+    header.vertexSize = sizeof(Vertex);
+    header.faceSize = sizeof(Face);
+    header.patchSize = sizeof(PatchFace);
+    header.patchGroupSize = sizeof(PatchGroup);
+    header.clusterCount = visData.clusterCount;
+    header.bytesPerCluster = visData.bytesPerCluster;
+    fwrite(&header, sizeof(CacheHeader), 1, out);
+
+    writeSection(out, header.sections[CACHE_FACE], faceArray);
+    writeSection(out, header.sections[CACHE_VERTEX], vertexArray);
+    writeSection(out, header.sections[CACHE_MESHINDEX], meshIndexArray);
+    writeSection(out, header.sections[CACHE_VISDATA], visData.words);
+    writeSection(out, header.sections[CACHE_LIGHTMAP], lightMapArray);
+    writeSection(out, header.sections[CACHE_PATCHVERTEX], patchVertexArray);
+    writeSection(out, header.sections[CACHE_PATCHINDEX], patchIndexArray);
+    writeSection(out, header.sections[CACHE_FACEPATCH], facePatches);
+    writeSection(out, header.sections[CACHE_PATCH], patchArray);
+    writeSection(out, header.sections[CACHE_PATCHGROUP], patchGroupArray);
+    writeSection(out, header.sections[CACHE_FACEBOUNDS], faceBoundsArray);
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(CacheHeader), 1, out);
+    bool failed = ferror(out) != 0;
+    failed = fclose(out) != 0 || failed;
+
+    if (failed)
+    {
+        remove(temporary.c_str());
+        std::cout << path << ": Could not write cache" << std::endl;
+        return;
+    }
+    remove(path.c_str());
+    rename(temporary.c_str(), path.c_str());
+}
@@ -0,0 +1,53 @@
+#ifndef MAPCACHE_HPP
+#define MAPCACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// Processed map data written after a load so the next load of the same
+// file can map it back in place. Sections are stored back to back, each
+// aligned to CACHE_ALIGNMENT, in the same layout as the arrays in Map.
+const int CACHE_VERSION = 6;
+const int CACHE_ALIGNMENT = 64;
+
+enum
+{
+    CACHE_FACE = 0,
+    CACHE_VERTEX,
+    CACHE_MESHINDEX,
+    CACHE_VISDATA,
+    CACHE_LIGHTMAP,
+    CACHE_PATCHVERTEX,
+    CACHE_PATCHINDEX,
+    CACHE_FACEPATCH,
+    CACHE_PATCH,
+    CACHE_PATCHGROUP,
+    CACHE_FACEBOUNDS,
+    CACHE_SECTIONCOUNT
+};
+
+struct CacheSection
+{
+    std::uint64_t offset;
+    std::uint64_t size;
+};
+
+struct CacheHeader
+{
+    char magic[4];
+    int version;
+    std::uint64_t hash;
+    int bezierLevel;
+    int lightMapAtlasSize;
+    int vertexSize;
+    int faceSize;
+    int patchSize;
+    int patchGroupSize;
+    int clusterCount;
+    int bytesPerCluster;
+    CacheSection sections[CACHE_SECTIONCOUNT];
+};
+
+std::uint64_t hashData(const char* data, std::size_t size);
+
+#endif // MAPCACHE_HPP
@@ -0,0 +1,321 @@
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <physfs.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "mappedfile.hpp"
+
+static unsigned int readU16(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long readU32(const unsigned char* p)
+{
+    return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static bool isDirectory(const std::string& hostPath)
+{
+    struct stat info;
+    if (stat(hostPath.c_str(), &info) != 0)
+        return false;
+    return (info.st_mode & S_IFMT) == S_IFDIR;
+}
+
+MappedFile::MappedFile()
+    : view(NULL)
+    , length(0)
+    , mapping(NULL)
+    , mappingSize(0)
+#ifdef _WIN32
+    , mappingHandle(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+
+    std::string name = path;
+    while (name.size() > 0 && name[0] == '/')
+        name.erase(0, 1);
+
+    const char* realDir = PHYSFS_getRealDir(name.c_str());
+    if (realDir)
+    {
+        std::string dir(realDir);
+        if (isDirectory(dir))
+        {
+            std::string dirsep = PHYSFS_getDirSeparator();
+            if (dir.length() > 0 && dir.substr(dir.length() - dirsep.length()) != dirsep)
+                dir.append(dirsep);
+            if (mapRange(dir + name, 0, 0))
+                return true;
+        }
+        else if (mapArchiveEntry(dir, name))
+        {
+            return true;
+        }
+    }
+
+    return readWhole(name);
+}
+
+bool MappedFile::openHost(const std::string& hostPath)
+{
+    close();
+    return mapRange(hostPath, 0, 0);
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+    if (mapping)
+        UnmapViewOfFile(mapping);
+    if (mappingHandle)
+        CloseHandle((HANDLE)mappingHandle);
+    mappingHandle = NULL;
+#else
+    if (mapping)
+        munmap(mapping, mappingSize);
+#endif
+    mapping = NULL;
+    mappingSize = 0;
+    view = NULL;
+    length = 0;
+    std::vector<char>().swap(buffer);
+}
+
+bool MappedFile::isOpen() const
+{
+    return view != NULL;
+}
+
+bool MappedFile::isMapped() const
+{
+    return mapping != NULL;
+}
+
+const char* MappedFile::data() const
+{
+    return view;
+}
+
+std::size_t MappedFile::size() const
+{
+    return length;
+}
+
+// Maps [offset, offset + length) of a file on the host filesystem, a
+// length of zero maps up to the end of the file.
+bool MappedFile::mapRange(const std::string& hostPath, std::size_t offset, std::size_t size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(hostPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || (unsigned long long)fileSize.QuadPart < offset + size)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    if (size == 0)
+        size = (std::size_t)fileSize.QuadPart - offset;
+    if (size == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    std::size_t start = offset - offset % info.dwAllocationGranularity;
+
+    HANDLE handle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!handle)
+        return false;
+
+    unsigned long long start64 = start;
+    void* address = MapViewOfFile(handle, FILE_MAP_READ, (DWORD)(start64 >> 32), (DWORD)(start64 & 0xFFFFFFFF), offset - start + size);
+    if (!address)
+    {
+        CloseHandle(handle);
+        return false;
+    }
+    mappingHandle = handle;
+#else
+    int fd = ::open(hostPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (std::size_t)info.st_size < offset + size)
+    {
+        ::close(fd);
+        return false;
+    }
+    if (size == 0)
+        size = (std::size_t)info.st_size - offset;
+    if (size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    std::size_t page = (std::size_t)sysconf(_SC_PAGESIZE);
+    std::size_t start = offset - offset % page;
+
+    void* address = mmap(NULL, offset - start + size, PROT_READ, MAP_PRIVATE, fd, start);
+    ::close(fd);
+    if (address == MAP_FAILED)
+        return false;
+#endif
+
+    mapping = address;
+    mappingSize = offset - start + size;
+    view = (const char*)address + (offset - start);
+    length = size;
+    return true;
+}
+
+// Locates an entry inside a zip archive and maps it if it is stored
+// without compression.
+bool MappedFile::mapArchiveEntry(const std::string& archivePath, const std::string& entryName)
+{
+    FILE* file = fopen(archivePath.c_str(), "rb");
+    if (!file)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+
+    // The end of central directory record sits in the last 64k + 22 bytes
+    long tailSize = fileSize < 65557 ? fileSize : 65557;
+    std::vector<unsigned char> tail(tailSize);
+    fseek(file, fileSize - tailSize, SEEK_SET);
+    if (tailSize < 22 || fread(&tail[0], 1, tailSize, file) != (std::size_t)tailSize)
+    {
+        fclose(file);
+        return false;
+    }
+
+    long eocd = -1;
+    for (long i = tailSize - 22; i >= 0; i--)
+    {
+        if (readU32(&tail[i]) == 0x06054b50)
+        {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd < 0)
+    {
+        fclose(file);
+        return false;
+    }
+
+    unsigned long directorySize = readU32(&tail[eocd + 12]);
+    unsigned long directoryOffset = readU32(&tail[eocd + 16]);
+    if (directorySize == 0 || directoryOffset + directorySize > (unsigned long)fileSize)
+    {
+        fclose(file);
+        return false;
+    }
+
+    std::vector<unsigned char> directory(directorySize);
+    fseek(file, directoryOffset, SEEK_SET);
+    if (fread(&directory[0], 1, directorySize, file) != directorySize)
+    {
+        fclose(file);
+        return false;
+    }
+
+    bool found = false;
+    unsigned long localOffset = 0;
+    unsigned long entrySize = 0;
+    for (unsigned long pos = 0; pos + 46 <= directorySize;)
+    {
+        const unsigned char* entry = &directory[pos];
+        if (readU32(entry) != 0x02014b50)
+            break;
+
+        unsigned int nameLength = readU16(entry + 28);
+        unsigned int extraLength = readU16(entry + 30);
+        unsigned int commentLength = readU16(entry + 32);
+        if (pos + 46 + nameLength > directorySize)
+            break;
+
+        if (nameLength == entryName.length() && memcmp(entry + 46, entryName.c_str(), nameLength) == 0)
+        {
+            unsigned int method = readU16(entry + 10);
+            unsigned long compressedSize = readU32(entry + 20);
+            unsigned long uncompressedSize = readU32(entry + 24);
+            if (method == 0 && compressedSize == uncompressedSize)
+            {
+                found = true;
+                localOffset = readU32(entry + 42);
+                entrySize = compressedSize;
+            }
+            break;
+        }
+        pos += 46 + nameLength + extraLength + commentLength;
+    }
+
+    unsigned char local[30];
+    fseek(file, localOffset, SEEK_SET);
+    if (!found || fread(local, 1, 30, file) != 30 || readU32(local) != 0x04034b50)
+    {
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    std::size_t dataOffset = localOffset + 30 + readU16(local + 26) + readU16(local + 28);
+    if (entrySize == 0 || dataOffset + entrySize > (unsigned long)fileSize)
+        return false;
+
+    return mapRange(archivePath, dataOffset, entrySize);
+}
+
+bool MappedFile::readWhole(const std::string& path)
+{
+    PHYSFS_File* file = PHYSFS_openRead(path.c_str());
+    if (!file)
+        return false;
+
+    PHYSFS_sint64 size = PHYSFS_fileLength(file);
+    if (size <= 0)
+    {
+        PHYSFS_close(file);
+        return false;
+    }
+
+    buffer.resize((std::size_t)size);
+    PHYSFS_sint64 readBytes = PHYSFS_read(file, &buffer[0], 1, (PHYSFS_uint32)size);
+    PHYSFS_close(file);
+    if (readBytes != size)
+    {
+        std::vector<char>().swap(buffer);
+        return false;
+    }
+
+    view = &buffer[0];
+    length = buffer.size();
+    return true;
+}
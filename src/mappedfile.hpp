@@ -0,0 +1,48 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole PhysFS file. Loose files and entries stored
+// uncompressed inside a pk3 are memory mapped directly, anything else is
+// read into memory with a single read. openHost() maps a file outside of
+// the PhysFS search path.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open(const std::string& path);
+	bool openHost(const std::string& hostPath);
+	void close();
+
+	bool isOpen() const;
+	bool isMapped() const;
+
+	const char* data() const;
+	std::size_t size() const;
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	bool mapRange(const std::string& hostPath, std::size_t offset, std::size_t size);
+	bool mapArchiveEntry(const std::string& archivePath, const std::string& entryName);
+	bool readWhole(const std::string& path);
+
+	const char* view;
+	std::size_t length;
+
+	void* mapping;
+	std::size_t mappingSize;
+#ifdef _WIN32
+	void* mappingHandle;
+#endif
+
+	std::vector<char> buffer;
+};
+
+#endif // MAPPEDFILE_HPP
@@ -0,0 +1,194 @@
+#include "profiler.hpp"
+
+#ifdef BSP_PROFILE
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+static thread_local ProfileBuffer* threadBuffer = NULL;
+
+Profiler::Profiler()
+    : paused(false)
+    , loaded(false)
+    , ring(256)
+    , ringStart(0)
+    , ringCount(0)
+{
+    frameStart = now();
+}
+
+Profiler& Profiler::instance()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+std::int64_t Profiler::now()
+{
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+const char* Profiler::counterName(ProfileCounter counter)
+{
+    static const char* names[COUNTER_COUNT] = {
+        "nodes visited",
+        "leaves pvs rejected",
+        "leaves frustum rejected",
+        "faces drawn",
+        "draw calls",
+        "texture binds",
+        "traces",
+        "brushes tested"
+    };
+    return names[counter];
+}
+
+// Drops the recorded frames
+void Profiler::setFrameLimit(std::size_t limit)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ring.assign(limit > 0 ? limit : 1, ProfileFrame());
+    ringStart = 0;
+    ringCount = 0;
+}
+
+void Profiler::setPaused(bool paused)
+{
+    this->paused.store(paused, std::memory_order_relaxed);
+}
+
+// Registered the first time a thread records something. Buffers are kept
+// after their thread exits so its last events still reach the frame. The
+// ids are small and in that same order, tid 0 is left for the frame track.
+ProfileBuffer& Profiler::buffer()
+{
+    if (!threadBuffer)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffers.push_back(std::unique_ptr<ProfileBuffer>(new ProfileBuffer()));
+        threadBuffer = buffers.back().get();
+        threadBuffer->thread = buffers.size();
+        for (int i = 0; i < COUNTER_COUNT; i++)
+            threadBuffer->counters[i] = 0;
+    }
+    return *threadBuffer;
+}
+
+void Profiler::record(const char* name, std::int64_t start, std::int64_t end)
+{
+    if (paused.load(std::memory_order_relaxed))
+        return;
+    ProfileBuffer& buffer = this->buffer();
+    ProfileEvent event = {name, start, end - start, buffer.thread};
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    buffer.events.push_back(event);
+}
+
+void Profiler::count(ProfileCounter counter, std::uint64_t value)
+{
+    if (paused.load(std::memory_order_relaxed))
+        return;
+    ProfileBuffer& buffer = this->buffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    buffer.counters[counter] += value;
+}
+
+// Called with the mutex held. The thread buffers keep their capacity, so
+// recording does not allocate once the frames are warm.
+void Profiler::close(ProfileFrame& frame)
+{
+    frame.start = frameStart;
+    frame.end = now();
+    frame.events.clear();
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        frame.counters[i] = 0;
+    for (std::size_t i = 0; i < buffers.size(); i++)
+    {
+        ProfileBuffer& buffer = *buffers[i];
+        std::lock_guard<std::mutex> lock(buffer.mutex);
+        frame.events.insert(frame.events.end(), buffer.events.begin(), buffer.events.end());
+        buffer.events.clear();
+        for (int j = 0; j < COUNTER_COUNT; j++)
+        {
+            frame.counters[j] += buffer.counters[j];
+            buffer.counters[j] = 0;
+        }
+    }
+    frameStart = frame.end;
+}
+
+void Profiler::endFrame()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::size_t index = (ringStart + ringCount) % ring.size();
+    if (ringCount == ring.size())
+        ringStart = (ringStart + 1) % ring.size();
+    else
+        ringCount++;
+    close(ring[index]);
+}
+
+void Profiler::endLoad()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    close(load);
+    loaded = true;
+}
+
+std::vector<ProfileFrame> Profiler::frames()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<ProfileFrame> result;
+    result.reserve(ringCount);
+    for (std::size_t i = 0; i < ringCount; i++)
+        result.push_back(ring[(ringStart + i) % ring.size()]);
+    return result;
+}
+
+static void writeFrame(std::ostream& out, const ProfileFrame& frame, const char* name)
+{
+    out << ",\n{\"name\": \"" << name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": 0"
+        << ", \"ts\": " << frame.start / 1000.0 << ", \"dur\": " << (frame.end - frame.start) / 1000.0 << "}";
+    for (std::size_t i = 0; i < frame.events.size(); i++)
+    {
+        const ProfileEvent& event = frame.events[i];
+        out << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+            << ", \"ts\": " << event.start / 1000.0 << ", \"dur\": " << event.duration / 1000.0 << "}";
+    }
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        out << ",\n{\"name\": \"" << Profiler::counterName((ProfileCounter)i) << "\", \"ph\": \"C\", \"pid\": 1"
+            << ", \"ts\": " << frame.start / 1000.0 << ", \"args\": {\"value\": " << frame.counters[i] << "}}";
+    }
+}
+
+// Trace event format, loads in chrome://tracing and Perfetto. Zone names
+// are string literals so they are written without escaping.
+bool Profiler::writeChromeTrace(const std::string& fileName)
+{
+    std::ofstream out(fileName.c_str());
+    if (!out)
+    {
+        std::cout << fileName << ": could not open" << std::endl;
+        return false;
+    }
+
+    std::vector<ProfileFrame> recorded = frames();
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    out << "{\"traceEvents\": [\n";
+    out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"frames\"}}";
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (loaded)
+            writeFrame(out, load, "load");
+    }
+    for (std::size_t i = 0; i < recorded.size(); i++)
+        writeFrame(out, recorded[i], "frame");
+    out << "\n]}\n";
+    return true;
+}
+
+#endif // BSP_PROFILE
@@ -0,0 +1,131 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+// Zones and counters for seeing where load and frame time goes. Built with
+// BSP_PROFILE they are kept for the last few frames and can be written out
+// as a Chrome trace, without it every macro below expands to nothing.
+
+enum ProfileCounter
+{
+    COUNTER_NODES = 0,
+    COUNTER_LEAVES_PVS,
+    COUNTER_LEAVES_FRUSTUM,
+    COUNTER_FACES,
+    COUNTER_DRAWCALLS,
+    COUNTER_TEXTUREBINDS,
+    COUNTER_TRACES,
+    COUNTER_BRUSHES,
+    COUNTER_COUNT
+};
+
+#ifdef BSP_PROFILE
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Times are in nanoseconds since the profiler started
+struct ProfileEvent {
+    const char* name;
+    std::int64_t start;
+    std::int64_t duration;
+    unsigned int thread;
+};
+
+struct ProfileFrame {
+    std::int64_t start;
+    std::int64_t end;
+    std::vector<ProfileEvent> events;
+    std::uint64_t counters[COUNTER_COUNT];
+};
+
+// Each thread records into its own buffer. Its lock is only contended
+// while endFrame() collects the buffers.
+struct ProfileBuffer {
+    std::mutex mutex;
+    std::vector<ProfileEvent> events;
+    std::uint64_t counters[COUNTER_COUNT];
+    unsigned int thread;
+};
+
+// Events go into the open frame until endFrame() moves it into a ring of
+// the last frameLimit frames. endLoad() keeps everything before it apart
+// so the load is not pushed out by later frames.
+class Profiler
+{
+public:
+    static Profiler& instance();
+
+    void setFrameLimit(std::size_t limit);
+    // Zones and counts are dropped while paused
+    void setPaused(bool paused);
+    void record(const char* name, std::int64_t start, std::int64_t end);
+    void count(ProfileCounter counter, std::uint64_t value);
+    void endFrame();
+    void endLoad();
+
+    // Oldest first, the open frame is not included
+    std::vector<ProfileFrame> frames();
+    bool writeChromeTrace(const std::string& fileName);
+
+    static std::int64_t now();
+    static const char* counterName(ProfileCounter counter);
+
+private:
+    Profiler();
+    Profiler(const Profiler&);
+    Profiler& operator=(const Profiler&);
+
+    ProfileBuffer& buffer();
+    void close(ProfileFrame& frame);
+
+    std::mutex mutex;
+    std::atomic<bool> paused;
+    std::vector<std::unique_ptr<ProfileBuffer> > buffers;
+    std::int64_t frameStart;
+    ProfileFrame load;
+    bool loaded;
+    std::vector<ProfileFrame> ring;
+    std::size_t ringStart;
+    std::size_t ringCount;
+};
+
+class ProfileZone
+{
+public:
+    explicit ProfileZone(const char* name)
+        : name(name)
+        , start(Profiler::now())
+    {
+    }
+
+    ~ProfileZone()
+    {
+        Profiler::instance().record(name, start, Profiler::now());
+    }
+
+private:
+    const char* name;
+    std::int64_t start;
+};
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_JOIN(profileZone, __LINE__)(name)
+#define PROFILE_COUNT(counter, value) Profiler::instance().count(counter, value)
+#define PROFILE_FRAME() Profiler::instance().endFrame()
+#define PROFILE_END_LOAD() Profiler::instance().endLoad()
+
+#else
+
+#define PROFILE_ZONE(name) ((void)0)
+#define PROFILE_COUNT(counter, value) ((void)0)
+#define PROFILE_FRAME() ((void)0)
+#define PROFILE_END_LOAD() ((void)0)
+
+#endif // BSP_PROFILE
+
+#endif // PROFILER_HPP
@@ -0,0 +1,352 @@
+#include <cstddef>
+#include <iostream>
+#include <physfs.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include "filestream.hpp"
+#include "profiler.hpp"
+#include "renderer.hpp"
+
+static GLenum attributeType(AttributeType type)
+{
+    switch (type)
+    {
+    case ATTRIBUTE_UNSIGNED_SHORT:
+        return GL_UNSIGNED_SHORT;
+    case ATTRIBUTE_INT_2_10_10_10:
+        return GL_INT_2_10_10_10_REV;
+    case ATTRIBUTE_UNSIGNED_BYTE:
+        return GL_UNSIGNED_BYTE;
+    default:
+        return GL_FLOAT;
+    }
+}
+
+#include "shaders.inc"
+
+Renderer::Renderer(Map& parent, ThreadPool* threadPool)
+    : map(parent)
+    , pool(threadPool)
+    , program(0)
+    , vertexBuffer(0)
+    , meshIndexBuffer(0)
+    , vertexFormat(VERTEXFORMAT_FULL)
+    , vertexLayout(VertexLayout::create(VERTEXFORMAT_FULL, Bounds()))
+    , textures(threadPool)
+    , uploadBudget(4)
+    , patchTolerance(2.f)
+{
+    stats.faces = 0;
+    stats.drawCalls = 0;
+    stats.textureBinds = 0;
+
+    glGenBuffers(1, &vertexBuffer);
+    glGenBuffers(1, &meshIndexBuffer);
+
+    GLint status;
+
+    GLuint vertShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertShader, 1, &vertSrc, NULL);
+    glCompileShader(vertShader);
+    glGetShaderiv(vertShader, GL_COMPILE_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        GLint length;
+        glGetShaderiv(vertShader, GL_INFO_LOG_LENGTH, &length);
+        char* log = new char[length + 1];
+        log[length] = '\0';
+        glGetShaderInfoLog(vertShader, length, &length, log);
+        std::cout << log << std::endl;
+        delete[] log;
+        return;
+    }
+
+    GLuint fragShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragShader, 1, &fragSrc, NULL);
+    glCompileShader(fragShader);
+    glGetShaderiv(fragShader, GL_COMPILE_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        GLint length;
+        glGetShaderiv(fragShader, GL_INFO_LOG_LENGTH, &length);
+        char* log = new char[length + 1];
+        log[length] = '\0';
+        glGetShaderInfoLog(fragShader, length, &length, log);
+        std::cout << log << std::endl;
+        glDeleteShader(vertShader);
+        delete[] log;
+        return;
+    }
+
+    program = glCreateProgram();
+    glAttachShader(program, vertShader);
+    glAttachShader(program, fragShader);
+
+    glBindAttribLocation(program, 0, "vertex");
+    //glBindAttribLocation(program, 1, "normal");
+    glBindAttribLocation(program, 2, "texcoord");
+    glBindAttribLocation(program, 3, "lmcoord");
+
+    glLinkProgram(program);
+
+    glDeleteShader(vertShader);
+    glDeleteShader(fragShader);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        GLint length;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+        char* log = new char[length + 1];
+        log[length] = '\0';
+        glGetProgramInfoLog(program, length, &length, log);
+        std::cout << log << std::endl;
+        delete[] log;
+        return;
+    }
+
+    programLoc["matrix"] = glGetUniformLocation(program, "matrix");
+    programLoc["texture"] = glGetUniformLocation(program, "texture");
+    programLoc["lightmap"] = glGetUniformLocation(program, "lightmap");
+}
+
+Renderer::~Renderer()
+{
+    glDeleteBuffers(1, &vertexBuffer);
+    glDeleteBuffers(1, &meshIndexBuffer);
+    if (program)
+        glDeleteProgram(program);
+}
+
+void Renderer::load()
+{
+    PROFILE_ZONE("Renderer::load");
+    glEnable(GL_TEXTURE_2D);
+
+    int shaderCount = map.shaderArray.size();
+    int lightMapCount = map.lightMapArray.size();
+
+    // Shader textures stream in over the next frames, while the lightmaps and
+    // buffers below are uploaded
+    textures.clear();
+    shaderTextures.assign(shaderCount, -1);
+    for (int i = 0; i < shaderCount; i++)
+    {
+        Shader &shader = map.shaderArray[i];
+        if (!shader.render || (shader.surface & SURF_NODRAW))
+            continue;
+        shaderTextures[i] = textures.request(shader.name);
+    }
+
+    // Lightmaps are packed into atlas pages, the vertices already point
+    // into them
+    const LightMapAtlas& atlas = map.lightMapAtlas;
+    std::vector<sf::Uint8> pixels((std::size_t)atlas.width() * atlas.height() * 4);
+    lightMapTextures.clear();
+    lightMapTextures.resize(atlas.pages);
+    for (int i = 0; i < atlas.pages; i++)
+    {
+        atlas.copyPage(i, map.lightMapArray.data(), lightMapCount, &pixels[0]);
+        sf::Image image;
+        image.create(atlas.width(), atlas.height(), &pixels[0]);
+        sf::Texture &texture = lightMapTextures[i];
+        texture.loadFromImage(image);
+        texture.setSmooth(true);
+    }
+
+    // Packed normals need GL 3.3, older drivers get full floats
+    VertexFormat format = vertexFormat;
+    if (format != VERTEXFORMAT_FULL && !GLEW_VERSION_3_3 && !GLEW_ARB_vertex_type_2_10_10_10_rev)
+        format = VERTEXFORMAT_FULL;
+    vertexLayout = VertexLayout::create(format, vertexBounds(map.vertexArray.data(), map.vertexArray.size()));
+
+    // Bezier levels go straight after the map's own vertices and indices
+    std::size_t vertexCount = map.vertexArray.size() + map.patchVertexArray.size();
+    if (vertexCount > 0)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, vertexCount * vertexLayout.stride, NULL, GL_STATIC_DRAW);
+        const Vertex* parts[] = { map.vertexArray.data(), map.patchVertexArray.data() };
+        std::size_t counts[] = { map.vertexArray.size(), map.patchVertexArray.size() };
+        std::size_t offset = 0;
+        std::vector<unsigned char> packed;
+        for (int i = 0; i < 2; i++)
+        {
+            if (counts[i] == 0)
+                continue;
+            if (vertexLayout.format == VERTEXFORMAT_FULL)
+            {
+                glBufferSubData(GL_ARRAY_BUFFER, offset, counts[i] * sizeof(Vertex), parts[i]);
+            }
+            else
+            {
+                packed.resize(counts[i] * vertexLayout.stride);
+                vertexLayout.pack(parts[i], counts[i], &packed[0]);
+                glBufferSubData(GL_ARRAY_BUFFER, offset, packed.size(), &packed[0]);
+            }
+            offset += counts[i] * vertexLayout.stride;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    std::size_t indexCount = map.meshIndexArray.size() + map.patchIndexArray.size();
+    if (indexCount > 0)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(GLuint), NULL, GL_STATIC_DRAW);
+        if (map.meshIndexArray.size() > 0)
+            glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, map.meshIndexArray.size() * sizeof(GLuint), map.meshIndexArray.data());
+        if (map.patchIndexArray.size() > 0)
+            glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, map.meshIndexArray.size() * sizeof(GLuint), map.patchIndexArray.size() * sizeof(GLuint), &map.patchIndexArray[0]);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+
+    glDisable(GL_TEXTURE_2D);
+}
+
+// One draw per batch, textures are only bound when they change from the
+// previous batch
+void Renderer::drawBatches()
+{
+    PROFILE_ZONE("Renderer::drawBatches");
+    drawOffsets.resize(drawList.rangeOffsets.size());
+    for (unsigned int i = 0; i < drawOffsets.size(); i++)
+    {
+        drawOffsets[i] = (const GLvoid*)(long)(drawList.rangeOffsets[i] * sizeof(GLuint));
+    }
+
+    const sf::Texture* boundTexture = NULL;
+    const sf::Texture* boundLightMap = NULL;
+    for (unsigned int i = 0; i < drawList.batches.size(); i++)
+    {
+        const DrawBatch& batch = drawList.batches[i];
+        const sf::Texture* texture = textures.get(shaderTextures[batch.shader]);
+        const sf::Texture* lightMap = &lightMapTextures[batch.lightMapPage];
+
+        if (i == 0 || texture != boundTexture)
+        {
+            glActiveTexture(GL_TEXTURE0);
+            sf::Texture::bind(texture);
+            boundTexture = texture;
+            stats.textureBinds++;
+        }
+        if (i == 0 || lightMap != boundLightMap)
+        {
+            glActiveTexture(GL_TEXTURE1);
+            sf::Texture::bind(lightMap);
+            boundLightMap = lightMap;
+            stats.textureBinds++;
+        }
+
+        if (batch.rangeCount > 1 && GLEW_VERSION_1_4)
+        {
+            glMultiDrawElements(GL_TRIANGLES, &drawList.rangeCounts[batch.rangeOffset], GL_UNSIGNED_INT, &drawOffsets[batch.rangeOffset], batch.rangeCount);
+            stats.drawCalls++;
+            continue;
+        }
+        for (int j = batch.rangeOffset; j < batch.rangeOffset + batch.rangeCount; j++)
+        {
+            glDrawElements(GL_TRIANGLES, drawList.rangeCounts[j], GL_UNSIGNED_INT, drawOffsets[j]);
+            stats.drawCalls++;
+        }
+    }
+    stats.faces += drawList.faces;
+}
+
+void Renderer::setUploadBudget(unsigned int budget)
+{
+    uploadBudget = budget;
+}
+
+// Largest error in pixels bezier faces may show, zero draws them all at
+// the level the map was loaded with
+void Renderer::setPatchTolerance(float pixels)
+{
+    patchTolerance = pixels;
+}
+
+// Takes effect on the next load
+void Renderer::setVertexFormat(VertexFormat format)
+{
+    vertexFormat = format;
+}
+
+const TextureStream& Renderer::getTextures() const
+{
+    return textures;
+}
+
+const RenderStats& Renderer::getStats() const
+{
+    return stats;
+}
+
+void Renderer::renderWorld(glm::mat4 matrix, glm::vec3 pos)
+{
+    PROFILE_ZONE("Renderer::renderWorld");
+    {
+        PROFILE_ZONE("textures");
+        textures.update(uploadBudget);
+    }
+
+    stats.faces = 0;
+    stats.drawCalls = 0;
+    stats.textureBinds = 0;
+
+    glFrontFace(GL_CW);
+    glEnable(GL_TEXTURE_2D);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LEQUAL);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
+
+    if (map.nodeArray.size() == 0)
+        return;
+
+    // Quantized positions are scaled back into world space by the matrix,
+    // culling still happens in world space
+    glm::mat4 vertexMatrix = glm::translate(matrix, vertexLayout.positionOffset);
+    vertexMatrix = glm::scale(vertexMatrix, vertexLayout.positionScale);
+
+    // Only the attributes the shaders read are enabled
+    const int enabled[] = { ATTRIBUTE_POSITION, ATTRIBUTE_TEXCOORD, ATTRIBUTE_LMCOORD };
+    glUseProgram(program);
+    for (unsigned int i = 0; i < sizeof(enabled) / sizeof(enabled[0]); i++)
+    {
+        const VertexAttribute& attribute = vertexLayout.attributes[enabled[i]];
+        glEnableVertexAttribArray(enabled[i]);
+        glVertexAttribPointer(enabled[i], attribute.components, attributeType(attribute.type), attribute.normalized ? GL_TRUE : GL_FALSE, vertexLayout.stride, (void*)(long)attribute.offset);
+    }
+    glUniformMatrix4fv(programLoc["matrix"], 1, GL_FALSE, &vertexMatrix[0][0]);
+    glUniform1i(programLoc["texture"], 0);
+    glUniform1i(programLoc["lightmap"], 1);
+
+    RenderPass& pass = renderPass;
+    pass.reset(pos, matrix);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    pass.patchTolerance = viewport[3] > 0 ? patchTolerance * 2.f / viewport[3] : 0.f;
+
+    glEnable(GL_CULL_FACE);
+    glDisable(GL_BLEND);
+    map.cullWorld(pass, true);
+    map.batchFaces(pass, true, drawList);
+    drawBatches();
+
+    glDisable(GL_CULL_FACE);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    map.cullWorld(pass, false);
+    map.batchFaces(pass, false, drawList);
+    drawBatches();
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glDisable(GL_TEXTURE_2D);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+
+    PROFILE_COUNT(COUNTER_FACES, stats.faces);
+    PROFILE_COUNT(COUNTER_DRAWCALLS, stats.drawCalls);
+    PROFILE_COUNT(COUNTER_TEXTUREBINDS, stats.textureBinds);
+}
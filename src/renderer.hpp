@@ -0,0 +1,60 @@
+#ifndef RENDERER_HPP
+#define RENDERER_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <glm/glm.hpp>
+#include <GL/glew.h>
+#include <SFML/Graphics/Texture.hpp>
+#include "bsp.hpp"
+#include "taskgraph.hpp"
+#include "texturestream.hpp"
+#include "vertexformat.hpp"
+
+struct RenderStats {
+    unsigned int faces;
+    unsigned int drawCalls;
+    unsigned int textureBinds;
+};
+
+class Renderer
+{
+protected:
+    Map &map;
+    ThreadPool* pool;
+
+    GLuint program;
+    GLuint vertexBuffer;
+    GLuint meshIndexBuffer;
+    VertexFormat vertexFormat;
+    VertexLayout vertexLayout;
+    std::map<std::string, GLuint> programLoc;
+
+    TextureStream textures;
+    std::vector<int> shaderTextures;
+    unsigned int uploadBudget;
+    float patchTolerance;
+    std::vector<sf::Texture> lightMapTextures;
+    RenderPass renderPass;
+    DrawList drawList;
+    std::vector<const GLvoid*> drawOffsets;
+    RenderStats stats;
+
+    void drawBatches();
+
+public:
+    Renderer(Map &parent, ThreadPool* threadPool = NULL);
+    ~Renderer();
+
+    void load();
+    void setUploadBudget(unsigned int budget);
+    void setVertexFormat(VertexFormat format);
+    void setPatchTolerance(float pixels);
+    const TextureStream& getTextures() const;
+    const RenderStats& getStats() const;
+
+    void renderWorld(glm::mat4 matrix, glm::vec3 pos);
+};
+
+#endif // RENDERER_HPP
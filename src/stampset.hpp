@@ -0,0 +1,52 @@
+#ifndef STAMPSET_HPP
+#define STAMPSET_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Set of indices which is emptied by bumping a generation counter instead
+// of clearing memory, so it can be reused every frame without allocating.
+class StampSet
+{
+private:
+    std::vector<unsigned int> stamps;
+    unsigned int stamp;
+
+public:
+    StampSet()
+        : stamp(0)
+    {
+    }
+
+    // Empties the set, only allocates when the size changes
+    void begin(std::size_t size)
+    {
+        if (stamps.size() != size)
+        {
+            stamps.assign(size, 0);
+            stamp = 0;
+        }
+        if (++stamp == 0)
+        {
+            std::fill(stamps.begin(), stamps.end(), 0);
+            stamp = 1;
+        }
+    }
+
+    bool contains(std::size_t index) const
+    {
+        return stamps[index] == stamp;
+    }
+
+    // Returns false if the index was already in the set
+    bool insert(std::size_t index)
+    {
+        if (stamps[index] == stamp)
+            return false;
+        stamps[index] = stamp;
+        return true;
+    }
+};
+
+#endif // STAMPSET_HPP
@@ -0,0 +1,282 @@
+#include "taskgraph.hpp"
+
+ThreadPool::ThreadPool(unsigned int threads)
+    : jobStart(0)
+    , jobCount(0)
+    , stopping(false)
+{
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        workers.push_back(std::thread(&ThreadPool::work, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    for (unsigned int i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+}
+
+void ThreadPool::submit(const std::function<void()>& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jobCount == jobs.size())
+        {
+            std::vector<std::function<void()> > grown(jobs.size() > 0 ? jobs.size() * 2 : 64);
+            for (std::size_t i = 0; i < jobCount; i++)
+                grown[i].swap(jobs[(jobStart + i) % jobs.size()]);
+            jobs.swap(grown);
+            jobStart = 0;
+        }
+        jobs[(jobStart + jobCount) % jobs.size()] = job;
+        jobCount++;
+    }
+    condition.notify_one();
+}
+
+// Called with the mutex held. Swapping leaves the empty function behind,
+// so the slot never holds a copy of a finished job.
+bool ThreadPool::pop(std::function<void()>& job)
+{
+    if (jobCount == 0)
+        return false;
+    job.swap(jobs[jobStart]);
+    jobStart = (jobStart + 1) % jobs.size();
+    jobCount--;
+    return true;
+}
+
+bool ThreadPool::runPending()
+{
+    std::function<void()> job;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!pop(job))
+            return false;
+    }
+    job();
+    return true;
+}
+
+unsigned int ThreadPool::size() const
+{
+    return workers.size();
+}
+
+// The thread waiting on the pool also runs jobs, so leave a core for it
+unsigned int ThreadPool::defaultThreads()
+{
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 0;
+}
+
+void ThreadPool::work()
+{
+    while (true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping && jobCount == 0)
+                condition.wait(lock);
+            if (!pop(job))
+                return;
+        }
+        job();
+    }
+}
+
+TaskGraph::Task TaskGraph::add(const std::function<void()>& job)
+{
+    return add(job, std::vector<Task>());
+}
+
+TaskGraph::Task TaskGraph::add(const std::function<void()>& job, Task dependency)
+{
+    return add(job, std::vector<Task>(1, dependency));
+}
+
+TaskGraph::Task TaskGraph::add(const std::function<void()>& job, const std::vector<Task>& dependencies)
+{
+    Task task = nodes.size();
+    Node node;
+    node.job = job;
+    node.waiting = dependencies.size();
+    nodes.push_back(node);
+    for (unsigned int i = 0; i < dependencies.size(); i++)
+    {
+        nodes[dependencies[i]].dependents.push_back(task);
+    }
+    return task;
+}
+
+TaskGraph::Task TaskGraph::addRange(int count, int grain, const std::function<void(int, int)>& job, const std::vector<Task>& dependencies)
+{
+    std::vector<Task> chunks;
+    for (int begin = 0; begin < count; begin += grain)
+    {
+        int end = begin + grain < count ? begin + grain : count;
+        chunks.push_back(add(std::bind(job, begin, end), dependencies));
+    }
+    if (chunks.empty())
+        chunks = dependencies;
+    return add(std::function<void()>(), chunks);
+}
+
+void TaskGraph::run(ThreadPool* pool)
+{
+    finished = 0;
+    int total = nodes.size();
+
+    std::vector<Task> ready;
+    for (int i = 0; i < total; i++)
+    {
+        if (nodes[i].waiting == 0)
+            ready.push_back(i);
+    }
+
+    if (!pool)
+    {
+        for (unsigned int i = 0; i < ready.size(); i++)
+        {
+            Task task = ready[i];
+            if (nodes[task].job)
+                nodes[task].job();
+            for (unsigned int j = 0; j < nodes[task].dependents.size(); j++)
+            {
+                Task next = nodes[task].dependents[j];
+                if (--nodes[next].waiting == 0)
+                    ready.push_back(next);
+            }
+        }
+        nodes.clear();
+        return;
+    }
+
+    for (unsigned int i = 0; i < ready.size(); i++)
+    {
+        start(pool, ready[i]);
+    }
+
+    while (true)
+    {
+        int seen;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            seen = finished;
+            if (seen == total)
+                break;
+        }
+        if (pool->runPending())
+            continue;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (finished == seen)
+            condition.wait(lock);
+    }
+    nodes.clear();
+}
+
+void TaskGraph::start(ThreadPool* pool, Task task)
+{
+    pool->submit([this, pool, task]()
+    {
+        if (nodes[task].job)
+            nodes[task].job();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (unsigned int i = 0; i < nodes[task].dependents.size(); i++)
+        {
+            Task next = nodes[task].dependents[i];
+            if (--nodes[next].waiting == 0)
+                start(pool, next);
+        }
+        finished++;
+        condition.notify_all();
+    });
+}
+
+ParallelRange::ParallelRange()
+    : function(NULL)
+    , job(NULL)
+    , count(0)
+    , grain(1)
+    , next(0)
+    , helpers(0)
+{
+}
+
+void ParallelRange::run(ThreadPool* pool, int count, int grain, void (*function)(const void*, int, int), const void* job)
+{
+    if (grain < 1)
+        grain = 1;
+    int chunks = (count + grain - 1) / grain;
+    int wanted = pool ? (int)pool->size() : 0;
+    if (wanted > chunks - 1)
+        wanted = chunks - 1;
+    if (wanted <= 0)
+    {
+        for (int begin = 0; begin < count; begin += grain)
+            function(job, begin, begin + grain < count ? begin + grain : count);
+        return;
+    }
+
+    this->function = function;
+    this->job = job;
+    this->count = count;
+    this->grain = grain;
+    next = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        helpers = wanted;
+    }
+
+    // Helpers may only start once the calling thread is already done, they
+    // then find nothing left and return straight away
+    for (int i = 0; i < wanted; i++)
+    {
+        pool->submit([this]()
+        {
+            work();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--helpers == 0)
+                condition.notify_all();
+        });
+    }
+    work();
+
+    // Every helper has to be out before the job goes out of scope
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (helpers == 0)
+                break;
+        }
+        if (pool->runPending())
+            continue;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (helpers != 0)
+            condition.wait(lock);
+    }
+}
+
+void ParallelRange::work()
+{
+    while (true)
+    {
+        int begin = next.fetch_add(grain);
+        if (begin >= count)
+            return;
+        function(job, begin, begin + grain < count ? begin + grain : count);
+    }
+}
@@ -0,0 +1,118 @@
+#ifndef TASKGRAPH_HPP
+#define TASKGRAPH_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads pulling jobs from a shared queue. Threads
+// waiting on work may help out through runPending(). The queue is a ring
+// that only grows, so submitting jobs small enough for std::function to
+// hold in place does not allocate once it is big enough.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned int threads = defaultThreads());
+    ~ThreadPool();
+
+    void submit(const std::function<void()>& job);
+    bool runPending();
+    unsigned int size() const;
+
+    static unsigned int defaultThreads();
+
+private:
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    void work();
+    bool pop(std::function<void()>& job);
+
+    std::vector<std::thread> workers;
+    std::vector<std::function<void()> > jobs;
+    std::size_t jobStart;
+    std::size_t jobCount;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping;
+};
+
+// Set of jobs with dependencies between them. A task is started once all
+// the tasks it depends on have finished.
+class TaskGraph
+{
+public:
+    typedef int Task;
+
+    Task add(const std::function<void()>& job);
+    Task add(const std::function<void()>& job, Task dependency);
+    Task add(const std::function<void()>& job, const std::vector<Task>& dependencies);
+
+    // Splits [0, count) into chunks of at most grain items, returns a task
+    // which finishes once all chunks have finished
+    Task addRange(int count, int grain, const std::function<void(int, int)>& job, const std::vector<Task>& dependencies);
+
+    // Runs every task and waits for them, a NULL pool runs them in order on
+    // the calling thread
+    void run(ThreadPool* pool);
+
+private:
+    struct Node
+    {
+        std::function<void()> job;
+        std::vector<Task> dependents;
+        int waiting;
+    };
+
+    void start(ThreadPool* pool, Task task);
+
+    std::vector<Node> nodes;
+    std::mutex mutex;
+    std::condition_variable condition;
+    int finished;
+};
+
+// One range split into chunks run by the pool and the calling thread, for
+// work done every frame. Unlike TaskGraph::addRange nothing is allocated
+// per run, the job is called through a plain pointer and the pool only
+// gets one small job per helper. Not reentrant.
+class ParallelRange
+{
+public:
+    ParallelRange();
+
+    // job(begin, end) is called for chunks of at most grain items, a NULL
+    // pool runs them all on the calling thread
+    template <typename F>
+    void run(ThreadPool* pool, int count, int grain, const F& job)
+    {
+        run(pool, count, grain, &call<F>, &job);
+    }
+
+private:
+    ParallelRange(const ParallelRange&);
+    ParallelRange& operator=(const ParallelRange&);
+
+    template <typename F>
+    static void call(const void* job, int begin, int end)
+    {
+        (*static_cast<const F*>(job))(begin, end);
+    }
+
+    void run(ThreadPool* pool, int count, int grain, void (*function)(const void*, int, int), const void* job);
+    void work();
+
+    void (*function)(const void*, int, int);
+    const void* job;
+    int count;
+    int grain;
+    std::atomic<int> next;
+    int helpers;
+    std::mutex mutex;
+    std::condition_variable condition;
+};
+
+#endif // TASKGRAPH_HPP
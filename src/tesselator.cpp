@@ -0,0 +1,135 @@
+#include <algorithm>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TESSELATOR_SSE2
+#include <emmintrin.h>
+#endif
+#include "tesselator.hpp"
+
+// Position, texture and lightmap coordinates, normal and colour
+const int COMPONENTS = 14;
+const int LANES = 4;
+
+static void loadComponents(const Vertex& vertex, float* out, int stride)
+{
+    out[0 * stride] = vertex.position.x;
+    out[1 * stride] = vertex.position.y;
+    out[2 * stride] = vertex.position.z;
+    out[3 * stride] = vertex.texCoord.x;
+    out[4 * stride] = vertex.texCoord.y;
+    out[5 * stride] = vertex.lmCoord.x;
+    out[6 * stride] = vertex.lmCoord.y;
+    out[7 * stride] = vertex.normal.x;
+    out[8 * stride] = vertex.normal.y;
+    out[9 * stride] = vertex.normal.z;
+    for (int i = 0; i < 4; i++)
+        out[(10 + i) * stride] = vertex.colour[i];
+}
+
+static void storeComponents(const float* in, int stride, Vertex& vertex)
+{
+    vertex.position = glm::vec3(in[0 * stride], in[1 * stride], in[2 * stride]);
+    vertex.texCoord = glm::vec2(in[3 * stride], in[4 * stride]);
+    vertex.lmCoord = glm::vec2(in[5 * stride], in[6 * stride]);
+    vertex.normal = glm::vec3(in[7 * stride], in[8 * stride], in[9 * stride]);
+    for (int i = 0; i < 4; i++)
+        vertex.colour[i] = (unsigned char)std::min(std::max(in[(10 + i) * stride] + 0.5f, 0.f), 255.f);
+}
+
+Tesselator::Tesselator(int level)
+    : level(std::max(level, 1))
+    , weights((this->level + 1) * 3)
+{
+    for (int i = 0; i <= this->level; i++)
+    {
+        float a = (float)i / this->level;
+        float b = 1.f - a;
+        weights[i * 3 + 0] = b * b;
+        weights[i * 3 + 1] = 2.f * b * a;
+        weights[i * 3 + 2] = a * a;
+    }
+}
+
+int Tesselator::getLevel() const
+{
+    return level;
+}
+
+// Rows of controls are blended first, then the columns of those results,
+// so each vertex costs six multiply adds per component instead of nine
+void Tesselator::run(const PatchJob* jobs, int count) const
+{
+    int size = level + 1;
+    std::vector<float> controls(COMPONENTS * 9 * LANES);
+    std::vector<float> rows(COMPONENTS * 3 * size * LANES);
+    float values[COMPONENTS * LANES];
+
+    for (int first = 0; first < count; first += LANES)
+    {
+        int lanes = std::min(count - first, LANES);
+
+        // controls[(c * 9 + k) * LANES + lane], the last job fills unused lanes
+        for (int lane = 0; lane < LANES; lane++)
+        {
+            const PatchJob& job = jobs[first + std::min(lane, lanes - 1)];
+            for (int k = 0; k < 9; k++)
+            {
+                const Vertex& control = job.controls[k % 3 + k / 3 * job.controlWidth];
+                loadComponents(control, &controls[k * LANES + lane], 9 * LANES);
+            }
+        }
+
+        // rows[((c * 3 + row) * size + i) * LANES + lane]
+        for (int c = 0; c < COMPONENTS; c++)
+        {
+            for (int row = 0; row < 3; row++)
+            {
+                const float* source = &controls[(c * 9 + row * 3) * LANES];
+                float* target = &rows[(c * 3 + row) * size * LANES];
+                for (int i = 0; i < size; i++)
+                {
+                    const float* weight = &weights[i * 3];
+#ifdef TESSELATOR_SSE2
+                    __m128 sum = _mm_mul_ps(_mm_set1_ps(weight[0]), _mm_loadu_ps(source));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weight[1]), _mm_loadu_ps(source + LANES)));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weight[2]), _mm_loadu_ps(source + 2 * LANES)));
+                    _mm_storeu_ps(target + i * LANES, sum);
+#else
+                    for (int lane = 0; lane < LANES; lane++)
+                    {
+                        target[i * LANES + lane] = weight[0] * source[lane] + weight[1] * source[LANES + lane] + weight[2] * source[2 * LANES + lane];
+                    }
+#endif
+                }
+            }
+        }
+
+        for (int i = 0; i < size; i++)
+        {
+            for (int j = 0; j < size; j++)
+            {
+                const float* weight = &weights[j * 3];
+                for (int c = 0; c < COMPONENTS; c++)
+                {
+                    const float* source = &rows[(c * 3 * size + i) * LANES];
+                    int rowStride = size * LANES;
+#ifdef TESSELATOR_SSE2
+                    __m128 sum = _mm_mul_ps(_mm_set1_ps(weight[0]), _mm_loadu_ps(source));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weight[1]), _mm_loadu_ps(source + rowStride)));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weight[2]), _mm_loadu_ps(source + 2 * rowStride)));
+                    _mm_storeu_ps(values + c * LANES, sum);
+#else
+                    for (int lane = 0; lane < LANES; lane++)
+                    {
+                        values[c * LANES + lane] = weight[0] * source[lane] + weight[1] * source[rowStride + lane] + weight[2] * source[2 * rowStride + lane];
+                    }
+#endif
+                }
+                for (int lane = 0; lane < lanes; lane++)
+                {
+                    const PatchJob& job = jobs[first + lane];
+                    storeComponents(values + lane, LANES, job.out[i * job.rowStride + j]);
+                }
+            }
+        }
+    }
+}
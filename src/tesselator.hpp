@@ -0,0 +1,33 @@
+#ifndef TESSELATOR_HPP
+#define TESSELATOR_HPP
+
+#include <vector>
+#include "bsp.hpp"
+
+// One 3x3 block of bezier controls and where its vertices go. Vertex (i, j)
+// of the grid, i running along a row of controls, is written to
+// out[i * rowStride + j].
+struct PatchJob {
+    const Vertex* controls;
+    int controlWidth;
+    Vertex* out;
+    int rowStride;
+};
+
+// Evaluates patches into grids of (level + 1) x (level + 1) vertices. The
+// Bernstein weights are worked out once per level and controls are gathered
+// into SoA form four patches at a time, one patch per SSE lane.
+class Tesselator
+{
+public:
+    explicit Tesselator(int level);
+
+    int getLevel() const;
+    void run(const PatchJob* jobs, int count) const;
+
+private:
+    int level;
+    std::vector<float> weights;
+};
+
+#endif // TESSELATOR_HPP
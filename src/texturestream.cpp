@@ -0,0 +1,213 @@
+#include <iostream>
+#include <physfs.h>
+#include "filestream.hpp"
+#include "texturestream.hpp"
+
+TextureStream::TextureStream(ThreadPool* threadPool)
+    : pool(threadPool)
+    , decoding(0)
+    , uploading(0)
+    , pendingBytes(0)
+{
+    sf::Uint8 pixels[4 * 4 * 4];
+    for (int i = 0; i < 4 * 4; i++)
+    {
+        sf::Uint8 shade = ((i ^ (i >> 2)) & 1) ? 160 : 96;
+        pixels[i * 4 + 0] = shade;
+        pixels[i * 4 + 1] = shade;
+        pixels[i * 4 + 2] = shade;
+        pixels[i * 4 + 3] = 255;
+    }
+    sf::Image image;
+    image.create(4, 4, pixels);
+    placeholder.loadFromImage(image);
+    placeholder.setRepeated(true);
+}
+
+TextureStream::~TextureStream()
+{
+    clear();
+}
+
+int TextureStream::request(const std::string& name)
+{
+    std::map<std::string, int>::iterator found = slots.find(name);
+    if (found != slots.end())
+        return found->second;
+
+    int slot = textures.size();
+    textures.push_back(sf::Texture());
+    states.push_back(Queued);
+    slots[name] = slot;
+
+    decoding++;
+    if (pool)
+    {
+        pool->submit([this, slot, name]()
+        {
+            decode(slot, name);
+        });
+    }
+    else
+    {
+        deferred.push_back(std::make_pair(slot, name));
+    }
+    return slot;
+}
+
+// Uploads at most budget decoded images, without a pool this is also where
+// the decoding happens
+void TextureStream::update(unsigned int budget)
+{
+    for (unsigned int i = 0; i < budget && !deferred.empty(); i++)
+    {
+        decode(deferred.front().first, deferred.front().second);
+        deferred.erase(deferred.begin());
+    }
+
+    for (unsigned int i = 0; i < budget; i++)
+    {
+        Decoded next;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (decoded.empty())
+                break;
+            next = decoded.front();
+            decoded.pop_front();
+        }
+
+        if (next.image)
+        {
+            sf::Texture &texture = textures[next.slot];
+            if (texture.loadFromImage(*next.image))
+            {
+#if SFML_VERSION_MAJOR > 2 || (SFML_VERSION_MAJOR == 2 && SFML_VERSION_MINOR >= 4)
+                texture.generateMipmap();
+#endif
+                texture.setRepeated(true);
+                texture.setSmooth(true);
+                states[next.slot] = Ready;
+            }
+            else
+            {
+                states[next.slot] = Missing;
+            }
+            sf::Vector2u size = next.image->getSize();
+            pendingBytes -= size.x * size.y * 4;
+            delete next.image;
+        }
+        else
+        {
+            states[next.slot] = Missing;
+        }
+        uploading--;
+    }
+}
+
+void TextureStream::clear()
+{
+    decoding -= deferred.size();
+    deferred.clear();
+    wait();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (unsigned int i = 0; i < decoded.size(); i++)
+    {
+        delete decoded[i].image;
+    }
+    decoded.clear();
+    uploading = 0;
+    pendingBytes = 0;
+    decoding = 0;
+
+    textures.clear();
+    states.clear();
+    slots.clear();
+}
+
+const sf::Texture* TextureStream::get(int slot) const
+{
+    if (slot < 0 || states[slot] == Missing)
+        return NULL;
+    if (states[slot] == Queued)
+        return &placeholder;
+    return &textures[slot];
+}
+
+unsigned int TextureStream::queueDepth() const
+{
+    return decoding + uploading;
+}
+
+unsigned int TextureStream::pendingDecodes() const
+{
+    return decoding;
+}
+
+unsigned int TextureStream::pendingUploads() const
+{
+    return uploading;
+}
+
+std::size_t TextureStream::bytesPending() const
+{
+    return pendingBytes;
+}
+
+void TextureStream::decode(int slot, const std::string& name)
+{
+    std::string path = name;
+    if (PHYSFS_exists(std::string(path + ".jpg").c_str()))
+    {
+        path += ".jpg";
+    }
+    else if (PHYSFS_exists(std::string(path + ".tga").c_str()))
+    {
+        path += ".tga";
+    }
+
+    Decoded result;
+    result.slot = slot;
+    result.image = NULL;
+
+    FileStream filestream(path);
+    if (filestream.isOpen())
+    {
+        sf::Image* image = new sf::Image();
+        if (image->loadFromStream(filestream))
+        {
+            result.image = image;
+            sf::Vector2u size = image->getSize();
+            pendingBytes += size.x * size.y * 4;
+        }
+        else
+        {
+            delete image;
+        }
+    }
+    else
+    {
+        std::cout << path + ": Texture not found\n" << std::flush;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        decoded.push_back(result);
+        uploading++;
+        // Under the lock so wait() cannot miss the last one
+        if (--decoding == 0)
+            decodesDone.notify_all();
+    }
+}
+
+// Outstanding jobs hold a pointer to us, so they have to finish first
+void TextureStream::wait()
+{
+    while (decoding > 0)
+    {
+        if (pool && pool->runPending())
+            continue;
+        std::unique_lock<std::mutex> lock(mutex);
+        decodesDone.wait(lock, [this]() { return decoding == 0; });
+    }
+}
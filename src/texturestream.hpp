@@ -0,0 +1,72 @@
+#ifndef TEXTURESTREAM_HPP
+#define TEXTURESTREAM_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <SFML/Graphics/Image.hpp>
+#include <SFML/Graphics/Texture.hpp>
+#include "taskgraph.hpp"
+
+// Loads shader textures in the background. Images are decoded on the pool
+// and uploaded a few at a time from update(), until then get() returns a
+// placeholder.
+class TextureStream
+{
+public:
+	explicit TextureStream(ThreadPool* pool);
+	~TextureStream();
+
+	int request(const std::string& name);
+	void update(unsigned int budget);
+	void clear();
+
+	const sf::Texture* get(int slot) const;
+
+	unsigned int queueDepth() const;
+	unsigned int pendingDecodes() const;
+	unsigned int pendingUploads() const;
+	std::size_t bytesPending() const;
+
+private:
+	TextureStream(const TextureStream&);
+	TextureStream& operator=(const TextureStream&);
+
+	enum State
+	{
+		Queued,
+		Ready,
+		Missing
+	};
+
+	struct Decoded
+	{
+		int slot;
+		sf::Image* image;
+	};
+
+	void decode(int slot, const std::string& name);
+	void wait();
+
+	ThreadPool* pool;
+	sf::Texture placeholder;
+
+	std::deque<sf::Texture> textures;
+	std::vector<State> states;
+	std::map<std::string, int> slots;
+	std::vector<std::pair<int, std::string> > deferred;
+
+	std::mutex mutex;
+	std::condition_variable decodesDone;
+	std::deque<Decoded> decoded;
+	std::atomic<unsigned int> decoding;
+	std::atomic<unsigned int> uploading;
+	std::atomic<std::size_t> pendingBytes;
+};
+
+#endif // TEXTURESTREAM_HPP
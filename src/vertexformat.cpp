@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "vertexformat.hpp"
+
+Bounds vertexBounds(const Vertex* vertices, std::size_t count)
+{
+    Bounds bounds;
+    bounds.min = glm::vec3(0.f);
+    bounds.max = glm::vec3(0.f);
+    for (std::size_t i = 0; i < count; i++)
+    {
+        bounds.min = i == 0 ? vertices[i].position : glm::min(bounds.min, vertices[i].position);
+        bounds.max = i == 0 ? vertices[i].position : glm::max(bounds.max, vertices[i].position);
+    }
+    return bounds;
+}
+
+static std::uint32_t packNormal(const glm::vec3& normal)
+{
+    std::uint32_t packed = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        float value = std::min(std::max(normal[i], -1.f), 1.f);
+        int component = (int)std::floor(value * 511.f + 0.5f);
+        packed |= ((std::uint32_t)component & 0x3ff) << (i * 10);
+    }
+    return packed;
+}
+
+static glm::vec3 unpackNormal(std::uint32_t packed)
+{
+    glm::vec3 normal;
+    for (int i = 0; i < 3; i++)
+    {
+        int component = (packed >> (i * 10)) & 0x3ff;
+        if (component & 0x200)
+            component -= 0x400;
+        normal[i] = std::max(component / 511.f, -1.f);
+    }
+    return normal;
+}
+
+static void setAttribute(VertexAttribute& attribute, int components, AttributeType type, bool normalized, int offset)
+{
+    attribute.components = components;
+    attribute.type = type;
+    attribute.normalized = normalized;
+    attribute.offset = offset;
+}
+
+VertexLayout VertexLayout::create(VertexFormat format, const Bounds& bounds)
+{
+    VertexLayout layout;
+    layout.format = format;
+    layout.positionOffset = glm::vec3(0.f);
+    layout.positionScale = glm::vec3(1.f);
+
+    switch (format)
+    {
+    // Texture coordinates stay floats, tiled textures reach values where a
+    // half float is off by a good part of a texel. Lightmap coordinates
+    // are 0 to 1 within an atlas page so they fit 16 bit fractions.
+    case VERTEXFORMAT_PACKED:
+        layout.stride = 32;
+        setAttribute(layout.attributes[ATTRIBUTE_POSITION], 3, ATTRIBUTE_FLOAT, false, 0);
+        setAttribute(layout.attributes[ATTRIBUTE_NORMAL], 4, ATTRIBUTE_INT_2_10_10_10, true, 12);
+        setAttribute(layout.attributes[ATTRIBUTE_TEXCOORD], 2, ATTRIBUTE_FLOAT, false, 16);
+        setAttribute(layout.attributes[ATTRIBUTE_LMCOORD], 2, ATTRIBUTE_UNSIGNED_SHORT, true, 24);
+        setAttribute(layout.attributes[ATTRIBUTE_COLOUR], 4, ATTRIBUTE_UNSIGNED_BYTE, true, 28);
+        break;
+    case VERTEXFORMAT_QUANTIZED:
+        layout.stride = 28;
+        layout.positionOffset = bounds.min;
+        layout.positionScale = glm::max(bounds.max - bounds.min, glm::vec3(1.f));
+        setAttribute(layout.attributes[ATTRIBUTE_POSITION], 3, ATTRIBUTE_UNSIGNED_SHORT, true, 0);
+        setAttribute(layout.attributes[ATTRIBUTE_NORMAL], 4, ATTRIBUTE_INT_2_10_10_10, true, 8);
+        setAttribute(layout.attributes[ATTRIBUTE_TEXCOORD], 2, ATTRIBUTE_FLOAT, false, 12);
+        setAttribute(layout.attributes[ATTRIBUTE_LMCOORD], 2, ATTRIBUTE_UNSIGNED_SHORT, true, 20);
+        setAttribute(layout.attributes[ATTRIBUTE_COLOUR], 4, ATTRIBUTE_UNSIGNED_BYTE, true, 24);
+        break;
+    default:
+        layout.format = VERTEXFORMAT_FULL;
+        layout.stride = sizeof(Vertex);
+        setAttribute(layout.attributes[ATTRIBUTE_POSITION], 3, ATTRIBUTE_FLOAT, false, offsetof(Vertex, position));
+        setAttribute(layout.attributes[ATTRIBUTE_NORMAL], 3, ATTRIBUTE_FLOAT, false, offsetof(Vertex, normal));
+        setAttribute(layout.attributes[ATTRIBUTE_TEXCOORD], 2, ATTRIBUTE_FLOAT, false, offsetof(Vertex, texCoord));
+        setAttribute(layout.attributes[ATTRIBUTE_LMCOORD], 2, ATTRIBUTE_FLOAT, false, offsetof(Vertex, lmCoord));
+        setAttribute(layout.attributes[ATTRIBUTE_COLOUR], 4, ATTRIBUTE_UNSIGNED_BYTE, true, offsetof(Vertex, colour));
+        break;
+    }
+    return layout;
+}
+
+void VertexLayout::pack(const Vertex* vertices, std::size_t count, unsigned char* out) const
+{
+    if (format == VERTEXFORMAT_FULL)
+    {
+        memcpy(out, vertices, count * sizeof(Vertex));
+        return;
+    }
+
+    memset(out, 0, count * stride);
+    for (std::size_t i = 0; i < count; i++)
+    {
+        const Vertex& vertex = vertices[i];
+        unsigned char* data = out + i * stride;
+
+        if (format == VERTEXFORMAT_QUANTIZED)
+        {
+            glm::vec3 position = (vertex.position - positionOffset) / positionScale;
+            for (int j = 0; j < 3; j++)
+            {
+                float value = std::min(std::max(position[j], 0.f), 1.f);
+                std::uint16_t component = (std::uint16_t)std::floor(value * 65535.f + 0.5f);
+                memcpy(data + attributes[ATTRIBUTE_POSITION].offset + j * 2, &component, 2);
+            }
+        }
+        else
+        {
+            memcpy(data + attributes[ATTRIBUTE_POSITION].offset, &vertex.position, 12);
+        }
+
+        std::uint32_t normal = packNormal(vertex.normal);
+        memcpy(data + attributes[ATTRIBUTE_NORMAL].offset, &normal, 4);
+
+        memcpy(data + attributes[ATTRIBUTE_TEXCOORD].offset, &vertex.texCoord, 8);
+        for (int j = 0; j < 2; j++)
+        {
+            float value = std::min(std::max(vertex.lmCoord[j], 0.f), 1.f);
+            std::uint16_t component = (std::uint16_t)std::floor(value * 65535.f + 0.5f);
+            memcpy(data + attributes[ATTRIBUTE_LMCOORD].offset + j * 2, &component, 2);
+        }
+        memcpy(data + attributes[ATTRIBUTE_COLOUR].offset, vertex.colour, 4);
+    }
+}
+
+// Decodes one vertex the same way GL would, for checking the error of a
+// layout on the CPU
+Vertex VertexLayout::unpack(const unsigned char* data) const
+{
+    Vertex vertex;
+    if (format == VERTEXFORMAT_FULL)
+    {
+        memcpy(&vertex, data, sizeof(Vertex));
+        return vertex;
+    }
+
+    if (format == VERTEXFORMAT_QUANTIZED)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            std::uint16_t component;
+            memcpy(&component, data + attributes[ATTRIBUTE_POSITION].offset + j * 2, 2);
+            vertex.position[j] = component / 65535.f * positionScale[j] + positionOffset[j];
+        }
+    }
+    else
+    {
+        memcpy(&vertex.position, data + attributes[ATTRIBUTE_POSITION].offset, 12);
+    }
+
+    std::uint32_t normal;
+    memcpy(&normal, data + attributes[ATTRIBUTE_NORMAL].offset, 4);
+    vertex.normal = unpackNormal(normal);
+
+    memcpy(&vertex.texCoord, data + attributes[ATTRIBUTE_TEXCOORD].offset, 8);
+    for (int j = 0; j < 2; j++)
+    {
+        std::uint16_t component;
+        memcpy(&component, data + attributes[ATTRIBUTE_LMCOORD].offset + j * 2, 2);
+        vertex.lmCoord[j] = component / 65535.f;
+    }
+    memcpy(vertex.colour, data + attributes[ATTRIBUTE_COLOUR].offset, 4);
+    return vertex;
+}
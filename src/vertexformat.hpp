@@ -0,0 +1,59 @@
+#ifndef VERTEXFORMAT_HPP
+#define VERTEXFORMAT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include "bsp.hpp"
+
+enum VertexFormat
+{
+    VERTEXFORMAT_FULL,
+    VERTEXFORMAT_PACKED,
+    VERTEXFORMAT_QUANTIZED
+};
+
+enum AttributeType
+{
+    ATTRIBUTE_FLOAT,
+    ATTRIBUTE_UNSIGNED_SHORT,
+    ATTRIBUTE_INT_2_10_10_10,
+    ATTRIBUTE_UNSIGNED_BYTE
+};
+
+// Attributes in the order of their shader locations
+enum
+{
+    ATTRIBUTE_POSITION = 0,
+    ATTRIBUTE_NORMAL,
+    ATTRIBUTE_TEXCOORD,
+    ATTRIBUTE_LMCOORD,
+    ATTRIBUTE_COLOUR,
+    ATTRIBUTE_COUNT
+};
+
+struct VertexAttribute {
+    int components;
+    AttributeType type;
+    bool normalized;
+    int offset;
+};
+
+// Describes how vertices are stored in the vertex buffer. Quantized
+// positions are stored as 0 to 1 within the bounds of the map and have to
+// be scaled back with positionScale and positionOffset.
+struct VertexLayout {
+    VertexFormat format;
+    int stride;
+    VertexAttribute attributes[ATTRIBUTE_COUNT];
+    glm::vec3 positionOffset;
+    glm::vec3 positionScale;
+
+    static VertexLayout create(VertexFormat format, const Bounds& bounds);
+
+    void pack(const Vertex* vertices, std::size_t count, unsigned char* out) const;
+    Vertex unpack(const unsigned char* data) const;
+};
+
+Bounds vertexBounds(const Vertex* vertices, std::size_t count);
+
+#endif // VERTEXFORMAT_HPP
@@ -0,0 +1,151 @@
+#include <cstring>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VISDATA_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include "visdata.hpp"
+
+static inline int popcount64(std::uint64_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return (int)__popcnt64(word);
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((word * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+static inline int lowestBit(std::uint64_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (int)index;
+#else
+    int index = 0;
+    while ((word & 1) == 0)
+    {
+        word >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+VisData::VisData()
+    : clusterCount(0)
+    , bytesPerCluster(0)
+    , wordsPerCluster(0)
+{
+}
+
+int VisData::wordsFor(int bytesPerCluster)
+{
+    return ((bytesPerCluster + 15) / 16) * 2;
+}
+
+// Rows [begin, end) of the raw lump, the padding bits stay clear. Words
+// are little endian like the lump so bit n of a row stays bit n.
+void VisData::unpack(const unsigned char* raw, int bytesPerCluster, int wordsPerCluster, std::uint64_t* out, int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+    {
+        std::uint64_t* row = out + (std::size_t)i * wordsPerCluster;
+        memset(row, 0, wordsPerCluster * sizeof(std::uint64_t));
+        memcpy(row, raw + (std::size_t)i * bytesPerCluster, bytesPerCluster);
+    }
+}
+
+bool VisData::empty() const
+{
+    return words.size() == 0;
+}
+
+const std::uint64_t* VisData::row(int cluster) const
+{
+    return words.data() + (std::size_t)cluster * wordsPerCluster;
+}
+
+bool VisData::test(int cluster, int other) const
+{
+    return (row(cluster)[other >> 6] >> (other & 63)) & 1;
+}
+
+void VisData::intersect(int a, int b, std::uint64_t* out) const
+{
+    const std::uint64_t* rowA = row(a);
+    const std::uint64_t* rowB = row(b);
+#ifdef VISDATA_SSE2
+    for (int i = 0; i < wordsPerCluster; i += 2)
+    {
+        __m128i left = _mm_loadu_si128((const __m128i*)(rowA + i));
+        __m128i right = _mm_loadu_si128((const __m128i*)(rowB + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_and_si128(left, right));
+    }
+#else
+    for (int i = 0; i < wordsPerCluster; i++)
+    {
+        out[i] = rowA[i] & rowB[i];
+    }
+#endif
+}
+
+void VisData::unite(int a, int b, std::uint64_t* out) const
+{
+    const std::uint64_t* rowA = row(a);
+    const std::uint64_t* rowB = row(b);
+#ifdef VISDATA_SSE2
+    for (int i = 0; i < wordsPerCluster; i += 2)
+    {
+        __m128i left = _mm_loadu_si128((const __m128i*)(rowA + i));
+        __m128i right = _mm_loadu_si128((const __m128i*)(rowB + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(left, right));
+    }
+#else
+    for (int i = 0; i < wordsPerCluster; i++)
+    {
+        out[i] = rowA[i] | rowB[i];
+    }
+#endif
+}
+
+int VisData::count(int cluster) const
+{
+    const std::uint64_t* bits = row(cluster);
+    int total = 0;
+    for (int i = 0; i < wordsPerCluster; i++)
+    {
+        total += popcount64(bits[i]);
+    }
+    return total;
+}
+
+// Writes the clusters visible from cluster into out, which needs room for
+// count(cluster) entries
+int VisData::enumerate(int cluster, int* out) const
+{
+    const std::uint64_t* bits = row(cluster);
+    int total = 0;
+    for (int i = 0; i < wordsPerCluster; i++)
+    {
+        std::uint64_t word = bits[i];
+        while (word)
+        {
+            int other = i * 64 + lowestBit(word);
+            if (other >= clusterCount)
+                return total;
+            out[total++] = other;
+            word &= word - 1;
+        }
+    }
+    return total;
+}
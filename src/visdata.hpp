@@ -0,0 +1,30 @@
+#ifndef VISDATA_HPP
+#define VISDATA_HPP
+
+#include <cstdint>
+#include "lumparray.hpp"
+
+// Potentially visible sets, one row of bits per cluster. Rows are padded to
+// a whole number of 128 bit blocks so they can be combined with SSE.
+struct VisData {
+    int clusterCount;
+    int bytesPerCluster;
+    int wordsPerCluster;
+    LumpArray<std::uint64_t> words;
+
+    VisData();
+
+    static int wordsFor(int bytesPerCluster);
+    static void unpack(const unsigned char* raw, int bytesPerCluster, int wordsPerCluster, std::uint64_t* out, int begin, int end);
+
+    bool empty() const;
+    const std::uint64_t* row(int cluster) const;
+    bool test(int cluster, int other) const;
+
+    void intersect(int a, int b, std::uint64_t* out) const;
+    void unite(int a, int b, std::uint64_t* out) const;
+    int count(int cluster) const;
+    int enumerate(int cluster, int* out) const;
+};
+
+#endif // VISDATA_HPP